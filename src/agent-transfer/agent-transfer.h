@@ -0,0 +1,122 @@
+/* libagenttransfer: move secret keys from gpg-agent to ssh-agent
+
+   A context holds one gpg-agent session and connections to one or
+   more ssh-agents, and can be used for any number of transfers, so a
+   long-running process doesn't need to fork agent-transfer per key.
+
+   Every call returns a gpg_error_t (0 on success; use gpg_strerror()
+   to describe it).  The library never writes to stdout or stderr
+   itself: human-readable details of what went wrong are passed to the
+   handler installed with agent_transfer_set_log_handler(), if any.
+
+   If libgcrypt has not been initialized by the time
+   agent_transfer_init() is called, it is initialized with a secure
+   memory pool sized for that context's ssh-agents, which is where key
+   material is kept, including the encoded keys on their way to
+   ssh-agent.  A program that initializes libgcrypt itself (or that
+   uses more than one context) should give it a pool of at least 96KiB
+   plus 32KiB for each ssh-agent socket that may be in use at once. */
+
+#ifndef AGENT_TRANSFER_H
+#define AGENT_TRANSFER_H
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <gpg-error.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AGENT_TRANSFER_KEYGRIP_LENGTH 40
+
+typedef struct agent_transfer agent_transfer_t;
+
+typedef void (*agent_transfer_log_handler_t) (void *arg, const char *fmt, va_list ap);
+
+struct agent_transfer_config {
+  /* the gpg-agent socket; NULL means $AGENT_TRANSFER_GPG_AGENT_SOCKET
+     or GnuPG's standard socket (gpg-agent is launched if needed) */
+  const char *gpg_agent_socket;
+  /* the ssh-agent sockets to send to; none means $SSH_AUTH_SOCK */
+  const char * const *ssh_sockets;
+  size_t nssh_sockets;
+  /* give up on an ssh-agent that makes no progress for this many
+     milliseconds; negative waits forever */
+  int timeout_ms;
+  /* ssh-agent constraints: lifetime in seconds (0 for none), and
+     whether each use must be confirmed */
+  unsigned int lifetime;
+  int confirm;
+  /* send keys even to agents that already hold them */
+  int force;
+  /* don't connect to any ssh-agent, e.g. when only exporting keys
+     with agent_transfer_export_openssh() */
+  int no_ssh_agent;
+  /* collect phase timings for agent_transfer_timing_report().  If
+     agent_transfer_init() fails, the timings up to the failure are
+     passed to the log handler instead, as one line like the report's
+     (JSON if this is AGENT_TRANSFER_TIMING_JSON). */
+  int timing;
+};
+
+#define AGENT_TRANSFER_TIMING_JSON 2
+
+/* one key to transfer or remove */
+struct agent_transfer_key {
+  const char *keygrip;
+  const char *comment; /* NULL for "GnuPG keygrip KEYGRIP" */
+  /* results, filled in by agent_transfer_keys(): */
+  gpg_error_t err;     /* the first failure, if any */
+  int skipped;         /* every ssh-agent already held it */
+};
+
+/* where diagnostics go; process-wide, like gcry_set_log_handler() */
+void agent_transfer_set_log_handler (agent_transfer_log_handler_t handler, void *arg);
+
+/* connect to gpg-agent and to each ssh-agent.  An ssh-agent that
+   can't be reached is reported and left out, but only if none of them
+   can be reached does this fail. */
+gpg_error_t agent_transfer_init (agent_transfer_t **atp, const struct agent_transfer_config *cfg);
+
+/* ask gpg-agent for every RSA and Ed25519 secret key it holds on
+   disk.  *KEYGRIPS is a malloc'ed array of *N malloc'ed strings. */
+gpg_error_t agent_transfer_discover (agent_transfer_t *at, char ***keygrips, size_t *n);
+
+/* flags for agent_transfer_keys() */
+#define AGENT_TRANSFER_REMOVE 1 /* take the keys away instead */
+#define AGENT_TRANSFER_FORCE  2 /* as the force setting, for this call */
+
+/* send the N KEYS to the ssh-agents (or take them away), pipelining
+   everything.  Each key's err and skipped are set; the return value
+   is the first failure of all.  This can be called as often as
+   needed over the life of the context. */
+gpg_error_t agent_transfer_keys (agent_transfer_t *at, struct agent_transfer_key *keys,
+                                 size_t n, unsigned int flags);
+
+/* export each of the N KEYS from gpg-agent and write it to FD as an
+   unencrypted OpenSSH private key (openssh-key-v1, what ssh-keygen
+   writes), one after another.  No ssh-agent is involved.  Each key's
+   err is set; the return value is the first failure of all. */
+gpg_error_t agent_transfer_export_openssh (agent_transfer_t *at, struct agent_transfer_key *keys,
+                                          size_t n, int fd);
+
+/* how ssh-agent number I fared in the last agent_transfer_keys()
+   call: how many requests it accepted and refused, and whether its
+   connection is still usable.  Returns GPG_ERR_NOT_FOUND when I is
+   past the last agent. */
+gpg_error_t agent_transfer_ssh_agent_status (agent_transfer_t *at, size_t i, const char **name,
+                                             size_t *accepted, size_t *refused, int *connected);
+
+/* write one line of accumulated phase timings to F, as key=value pairs
+   or (if JSON) as a JSON object */
+void agent_transfer_timing_report (agent_transfer_t *at, FILE *f, int json);
+
+/* disconnect, wipe and free everything */
+void agent_transfer_teardown (agent_transfer_t *at);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AGENT_TRANSFER_H */
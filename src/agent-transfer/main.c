@@ -1,637 +1,210 @@
 #define _GNU_SOURCE
 #include <stdio.h>
-#include <assuan.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <pwd.h>
-#include <gcrypt.h>
+#include <string.h>
 #include <ctype.h>
-#include <sys/socket.h>
-#include <sys/un.h>
-#include <arpa/inet.h>
+#include <strings.h>
+#include <signal.h>
+#include <time.h>
 #include <errno.h>
-#include <sys/select.h>
 
-#include "ssh-agent-proto.h"
+#include "agent-transfer.h"
 
-#define KEYGRIP_LENGTH 40
-#define KEYWRAP_ALGO GCRY_CIPHER_AES128
-#define KEYWRAP_ALGO_MODE GCRY_CIPHER_MODE_AESWRAP
+#define SSH_AGENT_TIMEOUT_DEFAULT 30
+#define DAEMON_INTERVAL_DEFAULT 60
 
-
-int custom_log (assuan_context_t ctx, void *hook, unsigned int cat, const char *msg) {
-  fprintf (stderr, "assuan (cat %d), %s\n", cat, msg);
-  return 1;
-}
-
-/* Count octets required after trimming whitespace off the end of
-   STRING and unescaping it.  Note that this will never be larger than
-   strlen (STRING).  This count does not include any trailing null
-   byte. */
-static size_t
-count_trimmed_unescaped (const char *string)
-{
-  size_t n = 0;
-  size_t last_non_whitespace = 0;
-
-  while (*string)
-    {
-      n++;
-      if (*string == '%' &&
-          string[1] && isxdigit(string[1]) &&
-          string[2] && isxdigit(string[2]))
-        {
-          string++;
-          string++;
-        }
-      else if (!isspace(*string))
-        {
-          last_non_whitespace = n;
-        }
-      string++;
-    }
-
-  return last_non_whitespace;
+static void log_to_stderr (void *arg, const char *fmt, va_list ap) {
+  vfprintf (stderr, fmt, ap);
 }
 
-#define xtoi_1(p)   (*(p) <= '9'? (*(p)- '0'): \
-                     *(p) <= 'F'? (*(p)-'A'+10):(*(p)-'a'+10))
-#define xtoi_2(p)   ((xtoi_1(p) * 16) + xtoi_1((p)+1))
-
-/* Trim whitespace off the right of STRING, unescape it, and return a
-   malloc'ed buffer of the correct size.  returns NULL on failure */
-static char *
-trim_and_unescape (const char *string)
-{
-  size_t sz = count_trimmed_unescaped (string);
-  char *p = malloc(sz+1);
-
-  if (!p)
-    return NULL;
-    
-  p[sz] = '\0';
-
-  for (int i = 0; i < sz; i++)
-    {
-      if (*string == '%' &&
-          string[1] && isxdigit(string[1]) &&
-          string[2] && isxdigit(string[2]))
-        {
-          string++;
-          p[i] = xtoi_2 (string);
-          string++;
-        }
-      else
-        p[i] = *string;
-      string++;
-    }
-
-  return (p);
-}
-
-#ifdef PATH_MAX
-#define BUFSIZE PATH_MAX
-#else
-#define BUFSIZE 4096
-#endif
-
-char* gpg_agent_sockname () {
-  FILE *f;
-  size_t bytecount, pos;
-  char buf[BUFSIZE];
-  int pipefd[2], wstatus;
-  pid_t pid, waited = 0;
-
-  if (pipe(pipefd)) {
-    fprintf (stderr, "Could not pipe (%d) %s\n", errno, strerror (errno));
-    return NULL;
-  }
-  pid = fork();
-  if (pid == 0) {
-    if (dup2 (pipefd[1], 1) == -1) {
-      fprintf (stderr, "failed to dup2 (%d) %s", errno, strerror (errno));
-      exit (1);
-    }
-    close (pipefd[0]);
-    /* FIXME: should we close other open file descriptors? gpgconf is
-       supposed to do that for us, but if we wanted to be defensive we
-       might want to do it here too. */
-    if (execlp ("gpgconf", "gpgconf", "--list-dirs", "agent-socket", NULL)) {
-      fprintf (stderr, "failed to execl (%d) %s", errno, strerror (errno));
-      exit (1);
-    }
-  }
-  close (pipefd[1]);
-  waited = waitpid (pid, &wstatus, 0);
-  if (waited != pid) {
-    fprintf (stderr, "waitpid failed (%d) %s\n", errno, strerror (errno));
-    close (pipefd[0]);
-    return NULL;
-  }
-  if (!WIFEXITED(wstatus)) {
-    fprintf (stderr, "'gpgconf --list-dirs agent-socket' did not exit cleanly!\n");
-    close (pipefd[0]);
-    return NULL;
-  }
-  if (WEXITSTATUS(wstatus)) {
-    fprintf (stderr, "'gpgconf --list-dirs agent-socket' exited with non-zero return code %d\n", WEXITSTATUS(wstatus));
-    close (pipefd[0]);
-    return NULL;
-  }
-  f = fdopen (pipefd[0], "r");
-  if (f == NULL) {
-    fprintf (stderr, "failed to get readable pipe (%d) %s\n", errno, strerror (errno));
-    close (pipefd[0]);
-    return NULL;
-  }
-  pos = 0;
-  while (!feof(f))
-    {
-      bytecount = fread(buf + pos, 1, sizeof(buf) - pos, f);
-      if (ferror(f)) {
-        fclose (f);
-        return NULL;
-      }
-      pos += bytecount;
-      if (pos >= sizeof(buf)) {/* too much data! */
-        fclose (f);
-        return NULL;
-      }
-    }
-  fclose (f);
-  buf[pos] = '\0';
-  return trim_and_unescape(buf);
+void usage (FILE *f) {
+  fprintf (f, "Usage: agent-transfer [options] KEYGRIP [COMMENT] [KEYGRIP [COMMENT]]...\n"
+           "       agent-transfer [options] - < KEYGRIP-LIST\n"
+           "       agent-transfer [options] -a\n"
+           "       agent-transfer [options] -D [-i SECONDS] [-a] [KEYGRIP...]\n"
+           "       agent-transfer [options] -o FD [-a] [KEYGRIP [COMMENT]]...\n"
+           "\n"
+           "Extracts secret keys from the GnuPG agent (by keygrip),\n"
+           "and sends them to the running SSH agent, or to each agent\n"
+           "named with -s (or, with -d, removes them, or with -o,\n"
+           "writes them out as OpenSSH private keys).\n"
+           "\n"
+           "  KEYGRIP should be a GnuPG keygrip\n"
+           "    (e.g. try \"gpg --with-keygrip --list-secret-keys\")\n"
+           "  COMMENT (optional) can be any string, and applies to the\n"
+           "    KEYGRIP just before it (must not start with a \"-\")\n"
+           "  -  read further keygrips from stdin, one per line,\n"
+           "    each optionally followed by whitespace and a comment\n"
+           "\n"
+           "Options:\n"
+           " -t SECONDS  lifetime (in seconds) for the key to live in ssh-agent\n"
+           " -a          also transfer every RSA and Ed25519 key gpg-agent holds\n"
+           " -c          require confirmation when using the key in ssh-agent\n"
+           " -d          remove the keys from ssh-agent instead of adding them\n"
+           " -D          keep running, putting back keys that go missing from\n"
+           "             ssh-agent, picking up new ones (with -a), and renewing\n"
+           "             keys before their -t lifetime runs out\n"
+           " -f          send keys even if ssh-agent already has them\n"
+           "             (e.g. to refresh the -t lifetime)\n"
+           " -s SOCKET   send to the ssh-agent listening on SOCKET instead of\n"
+           "             $SSH_AUTH_SOCK (may be given more than once)\n"
+           " -S SOCKET   talk to the gpg-agent listening on SOCKET\n"
+           " -T          report how long each phase took on stderr\n"
+           " -w SECONDS  give up if ssh-agent stalls for SECONDS (default: %d,\n"
+           "             0 waits forever)\n"
+           " -i SECONDS  with -D, check on things every SECONDS (default: %d)\n"
+           " -o FD       write the keys, unencrypted, in OpenSSH's private key\n"
+           "             format to file descriptor FD (1 for stdout) instead\n"
+           "             of sending them to ssh-agent\n"
+           " -h          print this help\n",
+           SSH_AGENT_TIMEOUT_DEFAULT, DAEMON_INTERVAL_DEFAULT);
 }
 
 
-typedef enum { kt_unknown = 0,
-               kt_rsa,
-               kt_ed25519
-} key_type;
-
-struct exporter {
-  assuan_context_t ctx;
-  gcry_cipher_hd_t wrap_cipher;
-  unsigned char *wrapped_key;
-  size_t wrapped_len;
-  unsigned char *unwrapped_key;
-  size_t unwrapped_len;
-  key_type ktype;
-  gcry_sexp_t sexp;
-  gcry_mpi_t n;
-  gcry_mpi_t e;
-  gcry_mpi_t d;
-  gcry_mpi_t p;
-  gcry_mpi_t q;
-  gcry_mpi_t iqmp;
-  gcry_mpi_t curve;
-  gcry_mpi_t flags;
+struct args {
+  int seconds;
+  int timeout;
+  int confirm;
+  int help;
+  int read_stdin;
+  int force;
+  int remove;
+  int discover;
+  int timing;
+  int daemon;
+  int interval;
+  int output_fd;
+  const char *gpg_agent_socket;
+  const char **ssh_sockets;
+  size_t nssh_sockets, ssh_sockets_alloc;
+  struct agent_transfer_key *keys;
+  size_t nkeys;
+  size_t keys_alloc;
 };
 
-/* percent_plus_escape is copyright Free Software Foundation */
-/* taken from common/percent.c in gnupg */
-/* Create a newly allocated string from STRING with all spaces and
-   control characters converted to plus signs or %xx sequences.  The
-   function returns the new string or NULL in case of a malloc
-   failure.
-
-   Note that we also escape the quote character to work around a bug
-   in the mingw32 runtime which does not correctly handle command line
-   quoting.  We correctly double the quote mark when calling a program
-   (i.e. gpg-protect-tool), but the pre-main code does not notice the
-   double quote as an escaped quote.  We do this also on POSIX systems
-   for consistency.  */
-char *
-percent_plus_escape (const char *string)
-{
-  char *buffer, *p;
-  const char *s;
-  size_t length;
-
-  for (length=1, s=string; *s; s++)
-    {
-      if (*s == '+' || *s == '\"' || *s == '%'
-          || *(const unsigned char *)s < 0x20)
-        length += 3;
-      else
-        length++;
-    }
-
-  buffer = p = malloc (length);
-  if (!buffer)
-    return NULL;
-
-  for (s=string; *s; s++)
-    {
-      if (*s == '+' || *s == '\"' || *s == '%'
-          || *(const unsigned char *)s < 0x20)
-        {
-          snprintf (p, 4, "%%%02X", *(unsigned char *)s);
-          p += 3;
-        }
-      else if (*s == ' ')
-        *p++ = '+';
-      else
-        *p++ = *s;
-    }
-  *p = 0;
-
-  return buffer;
-
-}
-
-
-
-gpg_error_t extend_wrapped_key (struct exporter *e, const void *data, size_t data_sz) {
-  size_t newsz = e->wrapped_len + data_sz;
-  unsigned char *wknew = realloc (e->wrapped_key, newsz);
-  if (!wknew)
-    return GPG_ERR_ENOMEM;
-  memcpy (wknew + e->wrapped_len, data, data_sz);
-  e->wrapped_key = wknew;
-  e->wrapped_len = newsz;
-  return GPG_ERR_NO_ERROR;
-}
-
-
-gpg_error_t unwrap_rsa_key (struct exporter *e) {
-  gpg_error_t ret;
-  e->iqmp = gcry_mpi_new(0);
-  ret = gcry_mpi_invm (e->iqmp, e->q, e->p);
-
-  if (!ret) {
-    fprintf (stderr, "Could not calculate the (inverse of q) mod p\n");
-    return GPG_ERR_GENERAL;
-  } else {
-    e->ktype = kt_rsa;
-    return GPG_ERR_NO_ERROR;
-  }
-}
-
-
-gpg_error_t unwrap_ed25519_key (struct exporter *e) {
-  unsigned int sz;
-  const char * data;
-
-#define opaque_compare(val, str, err)  {   \
-    data = gcry_mpi_get_opaque (val, &sz); \
-    if ((sz != strlen (str)*8) || !data || \
-        memcmp (data, str, strlen(str)))   \
-      return gpg_error (err); }
-  
-  /* verify that curve matches "Ed25519" */
-  opaque_compare (e->curve, "Ed25519", GPG_ERR_UNKNOWN_CURVE);
-
-  /* verify that flags contains "eddsa" */
-  /* FIXME: what if there are other flags besides eddsa? */
-  opaque_compare (e->flags, "eddsa", GPG_ERR_UNKNOWN_FLAG);
-  
-  /* verify that q starts with 0x40 and is 33 octets long */
-  data = gcry_mpi_get_opaque (e->q, &sz);
-  if (sz != 33*8 || !data || data[0] != 0x40)
-    return gpg_error (GPG_ERR_INV_CURVE);
-    /* verify that d is 32 octets long */
-  data = gcry_mpi_get_opaque (e->d, &sz);
-  if (sz < 32*8)
-    return gpg_error (GPG_ERR_TOO_SHORT);
-  if (sz > 32*8)
-    return gpg_error (GPG_ERR_TOO_LARGE);
-  if (!data)
-    return gpg_error (GPG_ERR_NO_OBJ);
-  
-  e->ktype = kt_ed25519;
-  return GPG_ERR_NO_ERROR;
-}
-
-
-gpg_error_t unwrap_key (struct exporter *e) {
-  unsigned char *out = NULL;
-  gpg_error_t ret;
-  const size_t sz_diff = 8;
-  /* need 8 octets less:
-
-     'GCRY_CIPHER_MODE_AESWRAP'
-     This mode is used to implement the AES-Wrap algorithm according to
-     RFC-3394.  It may be used with any 128 bit block length algorithm,
-     however the specs require one of the 3 AES algorithms.  These
-     special conditions apply: If 'gcry_cipher_setiv' has not been used
-     the standard IV is used; if it has been used the lower 64 bit of
-     the IV are used as the Alternative Initial Value.  On encryption
-     the provided output buffer must be 64 bit (8 byte) larger than the
-     input buffer; in-place encryption is still allowed.  On decryption
-     the output buffer may be specified 64 bit (8 byte) shorter than
-     then input buffer.  As per specs the input length must be at least
-     128 bits and the length must be a multiple of 64 bits. */
-
-  if ((e->ctx == NULL) ||
-      (e->wrap_cipher == NULL) ||
-      (e->wrapped_key == NULL) ||
-      (e->wrapped_len < 1))
-    return GPG_ERR_GENERAL; /* this exporter is not in the right state */
-
-
-  out = realloc (e->unwrapped_key, e->wrapped_len - sz_diff);
-  if (!out)
-    return GPG_ERR_ENOMEM;
-  e->unwrapped_key = out;
-  e->unwrapped_len = e->wrapped_len - sz_diff;
-
-  ret = gcry_cipher_decrypt (e->wrap_cipher,
-                             e->unwrapped_key, e->unwrapped_len,
-                             e->wrapped_key, e->wrapped_len);
-
-  if (ret)
-    return ret;
-  ret = gcry_sexp_new(&e->sexp, e->unwrapped_key, e->unwrapped_len, 0);
-  if (ret)
-    return ret;
-
-  /* RSA has: n, e, d, p, q */
-  ret = gcry_sexp_extract_param (e->sexp, "private-key!rsa", "nedpq",
-                                 &e->n, &e->e, &e->d, &e->p, &e->q, NULL);
-  if (!ret)
-    return unwrap_rsa_key (e);
-  
-  if (gpg_err_code (ret) == GPG_ERR_NOT_FOUND) {
-    /* check whether it's ed25519 */
-    /* EdDSA has: curve, flags, q, d */
-    ret = gcry_sexp_extract_param (e->sexp, "private-key!ecc", "/'curve''flags'qd",
-                                   &e->curve, &e->flags, &e->q, &e->d, NULL);
-    if (!ret)
-      return unwrap_ed25519_key (e);
-  }
-  return ret;
+int is_keygrip (const char *str) {
+  int idx;
+  if (strlen (str) != AGENT_TRANSFER_KEYGRIP_LENGTH)
+    return 0;
+  for (idx = 0; idx < AGENT_TRANSFER_KEYGRIP_LENGTH; idx++)
+    if (!isxdigit(str[idx]))
+      return 0;
+  return 1;
 }
 
-gpg_error_t data_cb (void *arg, const void *data, size_t data_sz) {
-  struct exporter *e = (struct exporter*)arg;
-  gpg_error_t ret;
-
-  if (e->wrap_cipher == NULL) {
-    size_t cipher_keylen = gcry_cipher_get_algo_keylen(KEYWRAP_ALGO);
-    if (data_sz != cipher_keylen) {
-      fprintf (stderr, "wrong number of bytes in keywrap key (expected %zu, got %zu)\n",
-               cipher_keylen, data_sz);
-      return GPG_ERR_INV_KEYLEN;
+/* append a new keygrip (and optional comment) to ARGS.  Both strings
+   are copied.  returns 0 on success. */
+int add_key_request (struct args *args, const char *keygrip, const char *comment) {
+  struct agent_transfer_key *k;
+  char *grip, *cmt = NULL;
+
+  if (args->nkeys == args->keys_alloc) {
+    size_t newalloc = args->keys_alloc ? args->keys_alloc * 2 : 8;
+    k = realloc (args->keys, newalloc * sizeof (*k));
+    if (!k) {
+      fprintf (stderr, "could not allocate space for %zu keygrips\n", newalloc);
+      return 1;
     }
-    ret = gcry_cipher_open (&(e->wrap_cipher), KEYWRAP_ALGO, KEYWRAP_ALGO_MODE, 0);
-    if (ret)
-      return ret;
-    ret = gcry_cipher_setkey (e->wrap_cipher, data, data_sz);
-    if (ret)
-      return ret;
-  } else {
-    return extend_wrapped_key (e, data, data_sz);
+    args->keys = k;
+    args->keys_alloc = newalloc;
+  }
+  grip = strdup (keygrip);
+  if (comment)
+    cmt = strdup (comment);
+  if (!grip || (comment && !cmt)) {
+    fprintf (stderr, "could not allocate space for keygrip %s\n", keygrip);
+    free (grip);
+    free (cmt);
+    return 1;
   }
+  k = args->keys + args->nkeys++;
+  memset (k, 0, sizeof (*k));
+  k->keygrip = grip;
+  k->comment = cmt;
   return 0;
 }
-gpg_error_t inquire_cb (void *arg, const char *prompt) {
-  fprintf (stderr, "inquire: %s\n", prompt);
-  return 0;
-}
-gpg_error_t status_cb (void *arg, const char *status) {
-  fprintf (stderr, "status: %s\n", status);
-  return 0;
-}
-
-gpg_error_t transact (struct exporter *e, const char *command) {
-  return assuan_transact (e->ctx, command, data_cb, e, inquire_cb, e, status_cb, e);
-}
-
-
-gpg_error_t sendenv (struct exporter *e, const char *env, const char *val, const char *option_name) {
-  char *str = NULL;
-  gpg_error_t ret;
-  int r;
-  if (!val)
-    val = getenv(env);
-
-  /* skip env vars that are unset */
-  if (!val)
-    return GPG_ERR_NO_ERROR;
-  if (option_name)
-    r = asprintf (&str, "OPTION %s=%s", option_name, val);
-  else
-    r = asprintf (&str, "OPTION putenv=%s=%s", env, val);
-
-  if (r <= 0)
-    return GPG_ERR_ENOMEM;
-  ret = transact (e, str);
-  free (str);
-  return ret;
-}
-
-size_t get_ssh_sz (gcry_mpi_t mpi) {
-  size_t wid;
-  gcry_mpi_print (GCRYMPI_FMT_SSH, NULL, 0, &wid, mpi);
-  return wid;
-}
-
-int send_to_ssh_agent(struct exporter *e, int fd, unsigned int seconds, int confirm, const char *comment) {
-  const char *key_type;
-  int ret;
-  size_t len, mpilen;
-  off_t offset;
-  unsigned char *msgbuf = NULL;
-  uint32_t tmp;
-  size_t slen;
-  ssize_t written, bytesread;
-  unsigned char resp;
-
-  if (e->ktype != kt_rsa && e->ktype != kt_ed25519) {
-    fprintf (stderr, "key is neither RSA nor Ed25519, cannot handle it.\n");
-    return -1;
-  }
-
-  if (e->ktype == kt_rsa) {
-    key_type = "ssh-rsa";
-    mpilen = get_ssh_sz (e->n) +
-      get_ssh_sz (e->e) +
-      get_ssh_sz (e->d) +
-      get_ssh_sz (e->iqmp) +
-      get_ssh_sz (e->p) +
-      get_ssh_sz (e->q);
-  } else if (e->ktype == kt_ed25519) {
-    key_type = "ssh-ed25519";
-    mpilen = 4 + 32 + /* ENC(A) */
-      4 + 64; /* k || ENC(A) */
-  }
-
-  len = 1 + /* request byte */
-    4 + strlen(key_type) + /* type of key */
-    mpilen +
-    4 + (comment ? strlen (comment) : 0) +
-    (confirm ? 1 : 0) +
-    (seconds ? 5 : 0);
-
-  msgbuf = malloc (4 + len);
-  if (msgbuf == NULL) {
-    fprintf (stderr, "could not allocate %zu bytes for the message to ssh-agent\n", 4 + len);
-    return -1;
-  }
 
-#define w32(a) { tmp = htonl(a); memcpy(msgbuf + offset, &tmp, sizeof(tmp)); offset += sizeof(tmp); }
-#define wstr(a) { slen = (a ? strlen (a) : 0); w32 (slen); if (a) memcpy (msgbuf + offset, a, slen); offset += slen; }
-#define wbyte(x) { msgbuf[offset] = (x); offset += 1; }
-#define wmpi(n) { ret = gcry_mpi_print (GCRYMPI_FMT_SSH, msgbuf + offset, get_ssh_sz (n), &slen, n); \
-    if (ret) { fprintf (stderr, "failed writing ssh mpi " #n "\n"); free (msgbuf); return -1; }; offset += slen; }
+int add_ssh_socket (struct args *args, const char *sock_name) {
+  const char **n;
 
-  offset = 0;
-  
-  w32 (len);
-  wbyte (seconds || confirm ? SSH2_AGENTC_ADD_ID_CONSTRAINED : SSH2_AGENTC_ADD_IDENTITY);
-  wstr (key_type);
-
-  if (e->ktype == kt_rsa) {
-    wmpi (e->n);
-    wmpi (e->e);
-    wmpi (e->d);
-    wmpi (e->iqmp);
-    wmpi (e->p);
-    wmpi (e->q);
-  } else if (e->ktype == kt_ed25519) {
-    unsigned int dsz, qsz;
-    const char *ddata, *qdata;
-    qdata = gcry_mpi_get_opaque (e->q, &qsz);
-    ddata = gcry_mpi_get_opaque (e->d, &dsz);
-    if (qsz != 33*8 || dsz != 32*8 || !qdata || !ddata) {
-      fprintf (stderr, "Ed25519 key did not have the expected components (q: %d %p, d: %d %p)\n",
-               qsz, qdata, dsz, ddata);
-      return -1;
+  if (args->nssh_sockets == args->ssh_sockets_alloc) {
+    size_t newalloc = args->ssh_sockets_alloc ? args->ssh_sockets_alloc * 2 : 4;
+    n = realloc (args->ssh_sockets, newalloc * sizeof (*n));
+    if (!n) {
+      fprintf (stderr, "could not allocate space for %zu ssh-agent sockets\n", newalloc);
+      return 1;
     }
-
-    /* ENC(A) (aka q)*/
-    w32 (32);
-    memcpy (msgbuf + offset, qdata+1, 32); offset += 32;
-    /* k || ENC(A) (aka d || q) */
-    w32 (64);
-    memcpy (msgbuf + offset, ddata, 32); offset += 32;
-    memcpy (msgbuf + offset, qdata+1, 32); offset += 32;
-  }
-  wstr (comment);
-  if (confirm)
-    wbyte (SSH_AGENT_CONSTRAIN_CONFIRM);
-  if (seconds) {
-    wbyte (SSH_AGENT_CONSTRAIN_LIFETIME);
-    w32 (seconds);
-  }
-  written = write (fd, msgbuf, 4+len);
-  if (written != 4 + len) {
-    fprintf (stderr, "failed writing message to ssh agent socket (%zd) (errno: %d)\n", written, errno);
-    free (msgbuf);
-    return -1;
-  }
-  free (msgbuf);
-
-  /* FIXME: this could actually be done in a select loop if we think the
-     ssh-agent will dribble out its response or not respond immediately.*/
-  bytesread = read (fd, &tmp, sizeof (tmp));
-  if (bytesread != sizeof (tmp)) {
-    fprintf (stderr, "failed to get %zu bytes from ssh-agent (got %zd)\n", sizeof (tmp), bytesread);
-    return -1;
-  }
-  slen = ntohl (tmp);
-  if (slen != sizeof(resp)) {
-    fprintf (stderr, "ssh-agent response was wrong size (expected: %zu; got %zu)\n", sizeof(resp), slen);
-    return -1;
+    args->ssh_sockets = n;
+    args->ssh_sockets_alloc = newalloc;
   }
-  bytesread = read (fd, &resp, sizeof (resp));
-  if (bytesread != sizeof (resp)) {
-    fprintf (stderr, "failed to get %zu bytes from ssh-agent (got %zd)\n", sizeof (resp), bytesread);
-    return -1;
-  }
-  if (resp != SSH_AGENT_SUCCESS) {
-    fprintf (stderr, "ssh-agent did not claim success (expected: %d; got %d)\n",
-             SSH_AGENT_SUCCESS, resp);
-    return -1;
-  }    
-    
+  args->ssh_sockets[args->nssh_sockets++] = sock_name;
   return 0;
 }
 
-void free_exporter (struct exporter *e) {
-  assuan_release (e->ctx);
-  if (e->wrap_cipher)
-    gcry_cipher_close (e->wrap_cipher);
-  free (e->wrapped_key);
-  free (e->unwrapped_key);
-  gcry_mpi_release(e->n);
-  gcry_mpi_release(e->d);
-  gcry_mpi_release(e->e);
-  gcry_mpi_release(e->p);
-  gcry_mpi_release(e->q);
-  gcry_mpi_release(e->iqmp);
-  gcry_mpi_release(e->curve);
-  gcry_mpi_release(e->flags);
-  gcry_sexp_release (e->sexp);
-}
-
-void usage (FILE *f) {
-  fprintf (f, "Usage: agent-transfer [options] KEYGRIP [COMMENT]\n"
-           "\n"
-           "Extracts a secret key from the GnuPG agent (by keygrip),\n"
-           "and sends it to the running SSH agent.\n"
-           "\n"
-           "  KEYGRIP should be a GnuPG keygrip\n"
-           "    (e.g. try \"gpg --with-keygrip --list-secret-keys\")\n"
-           "  COMMENT (optional) can be any string\n"
-           "    (must not start with a \"-\")\n"
-           "\n"
-           "Options:\n"
-           " -t SECONDS  lifetime (in seconds) for the key to live in ssh-agent\n"
-           " -c          require confirmation when using the key in ssh-agent\n"
-           " -h          print this help\n"
-           );
+void free_args (struct args *args) {
+  size_t i;
+  for (i = 0; i < args->nkeys; i++) {
+    free ((char *)args->keys[i].keygrip);
+    free ((char *)args->keys[i].comment);
+  }
+  free (args->keys);
+  args->keys = NULL;
+  args->nkeys = args->keys_alloc = 0;
+  free (args->ssh_sockets);
+  args->ssh_sockets = NULL;
+  args->nssh_sockets = args->ssh_sockets_alloc = 0;
 }
 
-int get_ssh_auth_sock_fd() {
-  char *sock_name = getenv("SSH_AUTH_SOCK");
-  struct sockaddr_un sockaddr;
-  int ret = -1;
-  if (sock_name == NULL) {
-    fprintf (stderr, "SSH_AUTH_SOCK is not set, cannot talk to agent.\n");
-    return -1;
-  }
-  if (strlen(sock_name) + 1 > sizeof(sockaddr.sun_path)) {
-    fprintf (stderr, "SSH_AUTH_SOCK (%s) is larger than the maximum allowed socket path (%zu)\n",
-             sock_name, sizeof(sockaddr.sun_path));
-    return -1;
-  }
-  sockaddr.sun_family = AF_UNIX;
-  strncpy(sockaddr.sun_path, sock_name, sizeof(sockaddr.sun_path) - 1);
-  sockaddr.sun_path[sizeof(sockaddr.sun_path) - 1] = '\0';
-  ret = socket (AF_UNIX, SOCK_STREAM, 0);
-  if (ret == -1) {
-    fprintf (stderr, "Could not open a socket file descriptor\n");
-    return ret;
+/* read "KEYGRIP [COMMENT]" lines from F.  Blank lines and lines
+   starting with # are ignored. */
+int read_key_requests (FILE *f, struct args *args) {
+  char *line = NULL, *grip, *comment, *end;
+  size_t linesz = 0;
+  ssize_t len;
+  int ret = 0;
+
+  while ((len = getline (&line, &linesz, f)) != -1) {
+    while (len > 0 && isspace(line[len - 1]))
+      line[--len] = '\0';
+    grip = line;
+    while (isspace(*grip))
+      grip++;
+    if (*grip == '\0' || *grip == '#')
+      continue;
+    for (end = grip; *end && !isspace(*end); end++);
+    comment = NULL;
+    if (*end) {
+      *end = '\0';
+      comment = end + 1;
+      while (isspace(*comment))
+        comment++;
+    }
+    if (!is_keygrip (grip)) {
+      fprintf (stderr, "keygrip must be 40 hexadecimal digits (got \"%s\" on stdin)\n", grip);
+      ret = 1;
+      break;
+    }
+    if (add_key_request (args, grip, comment)) {
+      ret = 1;
+      break;
+    }
   }
-  if (-1 == connect (ret, (const struct sockaddr*)(&sockaddr),
-                     sizeof(sockaddr))) {
-    fprintf (stderr, "Failed to connect to ssh agent socket %s\n", sock_name);
-    close (ret);
-    return -1;
+  if (ferror (f)) {
+    fprintf (stderr, "failed to read keygrips from stdin\n");
+    ret = 1;
   }
-
+  free (line);
   return ret;
 }
-
-struct args {
-  int seconds;
-  int confirm;
-  const char *comment;
-  const char *keygrip;
-  int help;
-};
-
 int parse_args (int argc, const char **argv, struct args *args) {
   int ptr = 1;
-  int idx = 0;
 
   while (ptr < argc) {
-    if (argv[ptr][0] == '-') {
-      int looking_for_seconds = 0;
+    if (argv[ptr][0] == '-' && argv[ptr][1] == '\0') {
+      args->read_stdin = 1;
+    } else if (argv[ptr][0] == '-') {
+      int looking_for_seconds = 0, looking_for_socket = 0, looking_for_timeout = 0;
+      int looking_for_ssh_socket = 0, looking_for_interval = 0, looking_for_fd = 0;
       const char *x = argv[ptr] + 1;
       while (*x != '\0') {
         switch (*x) {
@@ -644,6 +217,36 @@ int parse_args (int argc, const char **argv, struct args *args) {
         case 'h':
           args->help = 1;
           break;
+        case 'a':
+          args->discover = 1;
+          break;
+        case 'd':
+          args->remove = 1;
+          break;
+        case 'D':
+          args->daemon = 1;
+          break;
+        case 'i':
+          looking_for_interval = 1;
+          break;
+        case 'o':
+          looking_for_fd = 1;
+          break;
+        case 'f':
+          args->force = 1;
+          break;
+        case 's':
+          looking_for_ssh_socket = 1;
+          break;
+        case 'S':
+          looking_for_socket = 1;
+          break;
+        case 'T':
+          args->timing = 1;
+          break;
+        case 'w':
+          looking_for_timeout = 1;
+          break;
         default:
           fprintf (stderr, "flag not recognized: %c\n", *x);
           return 1;
@@ -662,28 +265,74 @@ int parse_args (int argc, const char **argv, struct args *args) {
         }
         ptr += 1;
       }
-    } else {
-      if (args->keygrip == NULL) {
-        if (strlen (argv[ptr]) != KEYGRIP_LENGTH) {
-          fprintf (stderr, "keygrip must be 40 hexadecimal digits\n");
+      if (looking_for_interval) {
+        if (argc <= ptr + 1) {
+          fprintf (stderr, "interval (-i) needs an argument (number of seconds)\n");
+          return 1;
+        }
+        args->interval = atoi (argv[ptr + 1]);
+        if (args->interval <= 0) {
+          fprintf (stderr, "interval (seconds) must be > 0\n");
+          return 1;
+        }
+        ptr += 1;
+      }
+      if (looking_for_fd) {
+        if (argc <= ptr + 1) {
+          fprintf (stderr, "output (-o) needs an argument (a file descriptor)\n");
+          return 1;
+        }
+        args->output_fd = atoi (argv[ptr + 1]);
+        if (!argv[ptr + 1][0] || strspn (argv[ptr + 1], "0123456789") != strlen (argv[ptr + 1])) {
+          fprintf (stderr, "output (-o) must be a file descriptor number\n");
+          return 1;
+        }
+        ptr += 1;
+      }
+      if (looking_for_ssh_socket) {
+        if (argc <= ptr + 1) {
+          fprintf (stderr, "ssh-agent socket (-s) needs an argument (a path)\n");
+          return 1;
+        }
+        if (add_ssh_socket (args, argv[ptr + 1]))
+          return 1;
+        ptr += 1;
+      }
+      if (looking_for_socket) {
+        if (argc <= ptr + 1) {
+          fprintf (stderr, "gpg-agent socket (-S) needs an argument (a path)\n");
           return 1;
         }
-        
-        for (idx = 0; idx < KEYGRIP_LENGTH; idx++) {
-          if (!isxdigit(argv[ptr][idx])) {
-            fprintf (stderr, "keygrip must be 40 hexadecimal digits\n");
-            return 1;
-          }
+        args->gpg_agent_socket = argv[ptr + 1];
+        ptr += 1;
+      }
+      if (looking_for_timeout) {
+        if (argc <= ptr + 1) {
+          fprintf (stderr, "timeout (-w) needs an argument (number of seconds)\n");
+          return 1;
         }
-        args->keygrip = argv[ptr];
-      } else {
-        if (args->comment == NULL) {
-          args->comment = argv[ptr];
-        } else {
-          fprintf (stderr, "unrecognized argument %s\n", argv[ptr]);
+        args->timeout = atoi (argv[ptr + 1]);
+        if (args->timeout < 0) {
+          fprintf (stderr, "timeout (seconds) must be >= 0\n");
           return 1;
         }
+        ptr += 1;
       }
+    } else if (is_keygrip (argv[ptr])) {
+      if (add_key_request (args, argv[ptr], NULL))
+        return 1;
+    } else if (args->nkeys == 0) {
+      fprintf (stderr, "keygrip must be 40 hexadecimal digits\n");
+      return 1;
+    } else if (args->keys[args->nkeys - 1].comment == NULL) {
+      args->keys[args->nkeys - 1].comment = strdup (argv[ptr]);
+      if (!args->keys[args->nkeys - 1].comment) {
+        fprintf (stderr, "could not allocate space for comment\n");
+        return 1;
+      }
+    } else {
+      fprintf (stderr, "unrecognized argument %s\n", argv[ptr]);
+      return 1;
     }
     ptr += 1;
   };
@@ -691,25 +340,229 @@ int parse_args (int argc, const char **argv, struct args *args) {
   return 0;
 }
 
-int main (int argc, const char* argv[]) {
+/* keys that came from gpg-agent itself (-a) are added unless they
+   were already asked for */
+int add_discovered (struct args *args, char **grips, size_t n) {
+  size_t i, j;
+  int ret = 0;
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < args->nkeys; j++)
+      if (!strcasecmp (args->keys[j].keygrip, grips[i]))
+        break;
+    if (j == args->nkeys && !ret && add_key_request (args, grips[i], NULL))
+      ret = 1;
+    free (grips[i]);
+  }
+  free (grips);
+  return ret;
+}
+
+static volatile sig_atomic_t stopping = 0, retrying = 0;
+
+static void stop_daemon (int sig) {
+  stopping = 1;
+}
+
+static void retry_keys (int sig) {
+  retrying = 1;
+}
+
+static time_t monotonic_seconds (void) {
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+/* did this go wrong because we lost gpg-agent or every ssh-agent? */
+static int session_lost (gpg_error_t err) {
+  gpg_err_code_t code = gpg_err_code (err);
+  return code == GPG_ERR_EPIPE || code == GPG_ERR_ECONNRESET || code == GPG_ERR_EOF ||
+    code == GPG_ERR_NO_AGENT ||
+    (code >= GPG_ERR_ASS_GENERAL && code <= GPG_ERR_ASS_UNKNOWN_INQUIRE);
+}
+
+/* Keep the ssh-agents in step with gpg-agent until we are told to
+   stop.  Every interval, anything missing from an ssh-agent is put
+   back (without a pinentry for keys that are still there), and with
+   -a, keys new to gpg-agent are picked up.  With a lifetime, each
+   key is renewed a little before it would expire.  If gpg-agent or
+   the ssh-agents go away, we connect afresh next time round.  A key
+   that can't be exported (say, its pinentry was cancelled) is left
+   alone until SIGHUP, or until -a finds new keys, so that it doesn't
+   bring up a pinentry every round. */
+int run_daemon (agent_transfer_t **atp, const struct agent_transfer_config *cfg,
+                struct args *args) {
+  struct sigaction sa;
+  struct agent_transfer_key *due = NULL;
+  size_t *dueidx = NULL;
+  time_t *renewed = NULL, now, next, expiry;
+  /* failed[i] is the round in which key i could not be exported, or 0 */
+  unsigned long *failed = NULL, round = 0;
+  /* renew a tenth of the lifetime early, but at least a second and at
+     most a minute */
+  time_t margin = args->seconds / 10 < 60 ? args->seconds / 10 : 60;
+  size_t i, n, ngrips, nrenewed = 0;
+  char **grips;
   gpg_error_t err;
-  char *gpg_agent_socket = NULL;
-  int ssh_sock_fd = 0;
-  char *get_key = NULL, *desc_prompt = NULL;
-  int idx = 0, ret = 0;
-  struct exporter e = { .wrapped_key = NULL };
-  /* ssh agent constraints: */
-  struct args args = { .keygrip = NULL };
-  char *escaped_comment = NULL;
-  char *alt_comment = NULL;
-  
-  if (!gcry_check_version (GCRYPT_VERSION)) {
-    fprintf (stderr, "libgcrypt version mismatch\n");
-    return 1;
+  int connected, lost;
+  size_t up;
+  struct timespec pause;
+
+  if (margin < 1 && args->seconds > 1)
+    margin = 1;
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = stop_daemon;
+  sigemptyset (&sa.sa_mask);
+  sigaction (SIGINT, &sa, NULL);
+  sigaction (SIGTERM, &sa, NULL);
+  sa.sa_handler = retry_keys;
+  sigaction (SIGHUP, &sa, NULL);
+  /* a vanished agent should be reconnected to, not kill us */
+  sa.sa_handler = SIG_IGN;
+  sigaction (SIGPIPE, &sa, NULL);
+
+  while (!stopping) {
+    lost = 0;
+    round++;
+    if (retrying) {
+      retrying = 0;
+      for (i = 0; i < nrenewed; i++)
+        failed[i] = 0;
+    }
+    if (!*atp && agent_transfer_init (atp, cfg))
+      goto wait;
+    /* an ssh-agent that was already down (say, -s names a socket
+       nobody is listening on) is not one we lost this round */
+    for (i = up = 0; !agent_transfer_ssh_agent_status (*atp, i, NULL, NULL, NULL, &connected); i++)
+      up += connected;
+
+    if (args->discover) {
+      if (agent_transfer_discover (*atp, &grips, &ngrips) == 0)
+        add_discovered (args, grips, ngrips);
+      else
+        lost = 1;
+    }
+
+    /* renewed[i] is when key i was last sent with a lifetime; 0 means
+       we don't know, so it gets sent straight away */
+    if (nrenewed < args->nkeys) {
+      time_t *r = realloc (renewed, args->nkeys * sizeof (*r));
+      unsigned long *f = realloc (failed, args->nkeys * sizeof (*f));
+      struct agent_transfer_key *d = realloc (due, args->nkeys * sizeof (*d));
+      size_t *di = realloc (dueidx, args->nkeys * sizeof (*di));
+      if (r)
+        renewed = r;
+      if (f)
+        failed = f;
+      if (d)
+        due = d;
+      if (di)
+        dueidx = di;
+      if (!r || !f || !d || !di) {
+        fprintf (stderr, "could not allocate space for %zu keys\n", args->nkeys);
+        break;
+      }
+      /* new keys are worth another try at the ones that failed */
+      for (i = 0; i < nrenewed; i++)
+        failed[i] = 0;
+      for (; nrenewed < args->nkeys; nrenewed++)
+        renewed[nrenewed] = failed[nrenewed] = 0;
+    }
+
+    now = monotonic_seconds ();
+    if (args->seconds) {
+      for (i = n = 0; i < args->nkeys; i++) {
+        if (failed[i] || (renewed[i] && now < renewed[i] + args->seconds - margin))
+          continue;
+        due[n] = args->keys[i];
+        dueidx[n++] = i;
+      }
+      if (n) {
+        agent_transfer_keys (*atp, due, n, AGENT_TRANSFER_FORCE);
+        for (i = 0; i < n; i++) {
+          if (!due[i].err)
+            renewed[dueidx[i]] = now;
+          else if (session_lost (due[i].err))
+            lost = 1;
+          else
+            failed[dueidx[i]] = round;
+        }
+      }
+    }
+
+    /* put back anything that has gone missing */
+    for (i = n = 0; i < args->nkeys; i++) {
+      if (failed[i])
+        continue;
+      due[n] = args->keys[i];
+      dueidx[n++] = i;
+    }
+    err = n ? agent_transfer_keys (*atp, due, n, 0) : 0;
+    for (i = 0; i < n; i++) {
+      if (!due[i].err && !due[i].skipped)
+        renewed[dueidx[i]] = now;
+      else if (session_lost (due[i].err))
+        lost = 1;
+      else if (due[i].err)
+        failed[dueidx[i]] = round;
+    }
+    if (session_lost (err))
+      lost = 1;
+    for (i = 0; !agent_transfer_ssh_agent_status (*atp, i, NULL, NULL, NULL, &connected); i++)
+      up -= connected;
+    if (up)
+      lost = 1;
+    /* a key that failed because we lost an agent wasn't marked, and
+       is tried again after reconnecting; these failed on their own */
+    for (i = 0; i < args->nkeys; i++)
+      if (failed[i] == round)
+        fprintf (stderr, "not trying key %s again until SIGHUP%s\n", args->keys[i].keygrip,
+                 args->discover ? " or new keys turn up" : "");
+    if (lost) {
+      fprintf (stderr, "lost touch with an agent, will reconnect\n");
+      agent_transfer_teardown (*atp);
+      *atp = NULL;
+    }
+
+  wait:
+    now = monotonic_seconds ();
+    next = now + args->interval;
+    if (args->seconds)
+      for (i = 0; i < nrenewed; i++) {
+        expiry = renewed[i] + args->seconds - margin;
+        if (renewed[i] && !failed[i] && expiry < next)
+          next = expiry;
+      }
+    pause.tv_sec = next > now ? next - now : 1;
+    pause.tv_nsec = 0;
+    /* a signal cuts this short */
+    while (!stopping && nanosleep (&pause, &pause) == -1 && errno == EINTR);
   }
-  gcry_control (GCRYCTL_DISABLE_SECMEM, 0);
-  gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
-  
+
+  free (renewed);
+  free (failed);
+  free (due);
+  free (dueidx);
+  return 0;
+}
+
+int main (int argc, const char* argv[]) {
+  gpg_error_t err;
+  agent_transfer_t *at = NULL;
+  struct agent_transfer_config cfg = { .gpg_agent_socket = NULL };
+  char **grips;
+  size_t i, ngrips, accepted, refused;
+  const char *name;
+  int connected, ret = 0;
+  struct args args = { .timeout = SSH_AGENT_TIMEOUT_DEFAULT,
+                       .interval = DAEMON_INTERVAL_DEFAULT,
+                       .output_fd = -1 };
+  const char *timing_env = getenv ("AGENT_TRANSFER_TIMING");
+
+  agent_transfer_set_log_handler (log_to_stderr, NULL);
+
   if (parse_args(argc, argv, &args)) {
     usage (stderr);
     return 1;
@@ -720,128 +573,81 @@ int main (int argc, const char* argv[]) {
     return 0;
   }
 
-  if (asprintf (&get_key, "EXPORT_KEY %s", args.keygrip) < 0) {
-    fprintf (stderr, "failed to generate key export string\n");
+  if (args.read_stdin && read_key_requests (stdin, &args))
     return 1;
-  }
 
-  if (args.comment &&
-      (escaped_comment = percent_plus_escape (args.comment), escaped_comment)) {
-    ret = asprintf (&desc_prompt,
-                    "SETKEYDESC Sending+key+for+'%s'+"
-                    "from+gpg-agent+to+ssh-agent...%%0a"
-                    "(keygrip:+%s)", escaped_comment, args.keygrip);
-    free (escaped_comment);
-  } else {
-    ret = asprintf (&desc_prompt,
-                    "SETKEYDESC Sending+key+from+gpg-agent+to+ssh-agent...%%0a"
-                    "(keygrip:+%s)", args.keygrip);
+  if (args.daemon && args.remove) {
+    fprintf (stderr, "-D and -d don't make sense together\n");
+    return 1;
   }
-  
-  if (ret < 0) {
-    fprintf (stderr, "failed to generate prompt description\n");
+  if (args.output_fd >= 0 &&
+      (args.daemon || args.remove || args.confirm || args.seconds || args.nssh_sockets)) {
+    fprintf (stderr, "-o writes keys out instead of talking to ssh-agent,"
+             " so -D, -d, -c, -t and -s don't apply\n");
     return 1;
   }
 
-  ssh_sock_fd = get_ssh_auth_sock_fd();
-  if (ssh_sock_fd == -1)
-    return 1;
-  
-  err = assuan_new (&(e.ctx));
-  if (err) {
-    fprintf (stderr, "failed to create assuan context (%d) (%s)\n", err, gpg_strerror (err));
+  if (args.nkeys == 0 && !args.discover) {
+    if (args.read_stdin)
+      return 0;
+    usage (stderr);
     return 1;
   }
-  gpg_agent_socket = gpg_agent_sockname();
-  if (gpg_agent_socket == NULL) {
-    fprintf (stderr, "failed to get gpg-agent socket name!\n");
+
+  cfg.gpg_agent_socket = args.gpg_agent_socket;
+  cfg.ssh_sockets = args.ssh_sockets;
+  cfg.nssh_sockets = args.nssh_sockets;
+  cfg.timeout_ms = args.timeout > 0 ? args.timeout * 1000 : -1;
+  cfg.lifetime = args.seconds;
+  cfg.confirm = args.confirm;
+  cfg.force = args.force;
+  cfg.no_ssh_agent = args.output_fd >= 0;
+  if (args.timing || (timing_env && *timing_env))
+    cfg.timing = timing_env && !strcmp (timing_env, "json") ? AGENT_TRANSFER_TIMING_JSON : 1;
+
+  err = agent_transfer_init (&at, &cfg);
+  if (err && !args.daemon)
     return 1;
-  }
-  
-  /* launch gpg-agent if it is not already connected */
-  err = assuan_socket_connect (e.ctx, gpg_agent_socket,
-                               ASSUAN_INVALID_PID, ASSUAN_SOCKET_CONNECT_FDPASSING);
-  if (err) {
-    if (gpg_err_code (err) != GPG_ERR_ASS_CONNECT_FAILED) {
-      fprintf (stderr, "failed to connect to gpg-agent socket (%d) (%s)\n",
-               err, gpg_strerror (err));
-    } else {
-      fprintf (stderr, "could not find gpg-agent, trying to launch it...\n");
-      int r = system ("gpgconf --launch gpg-agent");
-      if (r) {
-        fprintf (stderr, "failed to launch gpg-agent\n");
-        return 1;
-      }
-      /* try to connect again: */
-      err = assuan_socket_connect (e.ctx, gpg_agent_socket,
-                               ASSUAN_INVALID_PID, ASSUAN_SOCKET_CONNECT_FDPASSING);
-      if (err) {
-        fprintf (stderr, "failed to connect to gpg-agent after launching (%d) (%s)\n",
-                 err, gpg_strerror (err));
-        return 1;
-      }
-    }
+
+  if (args.daemon) {
+    ret = run_daemon (&at, &cfg, &args);
+    goto done;
   }
 
-  /* FIXME: what do we do if "getinfo std_env_names" includes something new? */
-  struct { const char *env; const char *val; const char *opt; } vars[] = {
-    { .env = "GPG_TTY", .val = ttyname(0), .opt = "ttyname" },
-    { .env = "TERM", .opt = "ttytype" },
-    { .env = "DISPLAY", .opt = "display" },
-    { .env = "XAUTHORITY", .opt = "xauthority" },
-    { .env = "GTK_IM_MODULE" },
-    { .env = "DBUS_SESSION_BUS_ADDRESS" },
-    { .env = "LANG", .opt = "lc-ctype" },
-    { .env = "LANG", .opt = "lc-messages" } };
-  for (idx = 0; idx < sizeof(vars)/sizeof(vars[0]); idx++) {
-    if (err = sendenv (&e, vars[idx].env, vars[idx].val, vars[idx].opt), err) {
-      fprintf (stderr, "failed to set %s (%s)\n", vars[idx].opt ? vars[idx].opt : vars[idx].env,
-               gpg_strerror(err));
+  if (args.discover) {
+    if (agent_transfer_discover (at, &grips, &ngrips) ||
+        add_discovered (&args, grips, ngrips)) {
+      ret = 1;
+      goto done;
     }
   }
-  err = transact (&e, "keywrap_key --export");
-  if (err) {
-    fprintf (stderr, "failed to export keywrap key (%d), %s\n", err, gpg_strerror(err));
-    return 1;
-  }
-  err = transact (&e, desc_prompt);
-  if (err) {
-    fprintf (stderr, "failed to set the description prompt (%d), %s\n", err, gpg_strerror(err));
-    return 1;
-  }
-  err = transact (&e, get_key);
-  if (err) {
-    fprintf (stderr, "failed to export secret key %s (%d), %s\n", args.keygrip, err, gpg_strerror(err));
-    return 1;
-  }
-  err = unwrap_key (&e);
-  if (err) {
-    fprintf (stderr, "failed to unwrap secret key (%d), %s\n", err, gpg_strerror(err));
-    return 1;
+  if (args.nkeys == 0)
+    goto done;
+
+  if (args.output_fd >= 0) {
+    if (agent_transfer_export_openssh (at, args.keys, args.nkeys, args.output_fd))
+      ret = 1;
+    goto done;
   }
 
-  if (!args.comment) {
-    int bytes_printed = asprintf (&alt_comment,
-                                  "GnuPG keygrip %s",
-                                  args.keygrip);
-    if (bytes_printed < 0) {
-      fprintf (stderr, "failed to generate key comment\n");
-      return 1;
-    }
+  if (agent_transfer_keys (at, args.keys, args.nkeys, args.remove ? AGENT_TRANSFER_REMOVE : 0))
+    ret = 1;
+
+  /* when fanning out to several agents, say how each one fared */
+  for (i = 0; !agent_transfer_ssh_agent_status (at, i, &name, &accepted, &refused, &connected); i++) {
+    if (!connected)
+      ret = 1;
+    if (args.nssh_sockets > 1)
+      fprintf (stderr, "%s: %zu %s, %zu failed%s\n", name, accepted,
+               args.remove ? "removed" : "added", refused,
+               connected ? "" : " (connection failed)");
   }
-  
-  err = send_to_ssh_agent (&e, ssh_sock_fd, args.seconds, args.confirm,
-                           args.comment ? args.comment : alt_comment);
-  if (err)
-    return 1;
-  
-  /*  fwrite (e.unwrapped_key, e.unwrapped_len, 1, stdout); */
-
-  close (ssh_sock_fd);
-  free (gpg_agent_socket);
-  free (get_key);
-  free (desc_prompt);
-  free (alt_comment);
-  free_exporter (&e);
-  return 0;
+
+ done:
+  /* (a failed agent_transfer_init() has already logged its timings) */
+  if (cfg.timing && at)
+    agent_transfer_timing_report (at, stderr, cfg.timing == AGENT_TRANSFER_TIMING_JSON);
+  agent_transfer_teardown (at);
+  free_args (&args);
+  return ret;
 }
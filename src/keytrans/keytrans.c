@@ -0,0 +1,1220 @@
+/* keytrans: native implementation of openpgp2ssh, openpgp2pem and
+   openpgp2spki
+
+   This does the same job as the Perl keytrans in src/share (which
+   remains the only implementation of pem2openpgp, and the fallback
+   where this one isn't built): take a stream of OpenPGP packets on
+   standard input and an optional key ID or fingerprint as the first
+   argument, find the matching RSA key (or, for openpgp2ssh, Ed25519 or
+   ECDSA public key), and write it out.  The output
+   is byte-for-byte what the Perl version writes, and so are the
+   messages for the cases it complains about, but there is no
+   interpreter or module loading to pay for on every call.
+
+   Like the Perl version, how it behaves depends on the name it is
+   invoked under.  Unlike it, it can look keys up through an index of
+   the keyring (see OPENPGP2SSH_INDEX below).
+
+   License: GPL v3 or later */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <gcrypt.h>
+
+/* see RFC 4880 section 4.3 */
+#define PKT_SECKEY 5
+#define PKT_PUBKEY 6
+#define PKT_SEC_SUBKEY 7
+#define PKT_PUB_SUBKEY 14
+
+/* see RFC 4880 section 9.1, RFC 6637 section 5 and
+   draft-ietf-openpgp-rfc4880bis section 9.1 */
+#define ALGO_RSA 1
+#define ALGO_ECDSA 19
+#define ALGO_EDDSA 22
+
+/* the length findkey() is given for a packet whose body is streamed
+   (see packetwalk()): it stops at the end of the body, but there is
+   no telling where that is before getting there */
+#define PACKET_LENGTH_STREAMED ((size_t)-1)
+
+#define FPR_LENGTH 20
+#define FPR_HEX_LENGTH 40
+
+/* standard input is read through a buffer this big (a seek that
+   lands within it does not go back to the file) */
+#define INPUT_BUFFER_SIZE (1 << 20)
+
+/* the size of the input, if it is a regular file (so that skipped
+   packets can be seeked over rather than read), or -1 */
+static off_t input_size = -1;
+
+/* a growable buffer, for DER and for raw key packets */
+struct der {
+  unsigned char *buf;
+  size_t len, alloc;
+  int secret;
+};
+
+struct rsa_key {
+  gcry_mpi_t n, e, d, p, q;
+  int secret;
+  /* or, for an elliptic curve key (openpgp2ssh only), its OpenSSH key
+     type and public key blob */
+  const char *ssh;
+  struct der sshblob;
+};
+
+/* the elliptic curve keys OpenSSH can use, by the curve OID as it
+   appears in the key packet (see RFC 6637 section 11 and
+   draft-ietf-openpgp-rfc4880bis section 9.2).  QLEN and PREFIX
+   describe the public point MPI: 0x40 and the native Ed25519 key, or
+   an uncompressed SEC1 point. */
+static const struct ssh_curve {
+  unsigned int algo;
+  size_t oidlen;
+  const char *oid;
+  const char *type, *curve;
+  size_t qlen;
+  unsigned char prefix;
+} ssh_curves[] = {
+  { ALGO_EDDSA, 9, "\x2b\x06\x01\x04\x01\xda\x47\x0f\x01", "ssh-ed25519", NULL, 33, 0x40 },
+  { ALGO_ECDSA, 8, "\x2a\x86\x48\xce\x3d\x03\x01\x07", "ecdsa-sha2-nistp256", "nistp256", 65, 0x04 },
+  { ALGO_ECDSA, 5, "\x2b\x81\x04\x00\x22", "ecdsa-sha2-nistp384", "nistp384", 97, 0x04 },
+  { ALGO_ECDSA, 5, "\x2b\x81\x04\x00\x23", "ecdsa-sha2-nistp521", "nistp521", 133, 0x04 },
+};
+
+/* fingerprints already printed by openpgp2ssh --all, in an open
+   addressing hash table */
+struct fpr_set {
+  char (*slots)[FPR_HEX_LENGTH + 1];
+  size_t n, alloc;
+};
+
+struct search {
+  const char *fpr; /* upper-case, or NULL to match anything */
+  int all; /* print every key as it is found, not just one */
+  int ssh; /* elliptic curve keys will do, too */
+  int found;
+  int current_key_match;
+  struct rsa_key key;
+  struct fpr_set seen;
+  struct der pub; /* the public part of the current key packet */
+};
+
+static void put_ssh (const struct rsa_key *k);
+
+/* like perl's die: the message goes to stderr, and the exit code is
+   255 */
+static void die (const char *fmt, ...) {
+  va_list ap;
+
+  va_start (ap, fmt);
+  vfprintf (stderr, fmt, ap);
+  va_end (ap);
+  exit (255);
+}
+
+/* read up to LEN octets, with the semantics of perl's read() (which
+   the Perl keytrans relies on): a short read is not an error, but
+   getting nothing at all (including when LEN is 0) is. */
+static size_t read_or_die (FILE *in, void *buf, size_t len, const char *msg) {
+  size_t got = len ? fread (buf, 1, len, in) : 0;
+
+  if (got == 0)
+    die ("%s", msg);
+  return got;
+}
+
+/* skip LEN octets of input, which (as with read_or_die()) is an error
+   only if there is nothing there at all.  a regular file is seeked
+   through, so nothing is copied. */
+static void skip_or_die (FILE *in, size_t len, const char *msg) {
+  unsigned char buf[4096];
+  size_t got, want, skipped = 0;
+  off_t pos;
+
+  if (len == 0)
+    die ("%s", msg);
+  if (input_size >= 0 && (pos = ftello (in)) >= 0) {
+    if (pos >= input_size)
+      die ("%s", msg);
+    if (len > (size_t)(input_size - pos))
+      len = input_size - pos;
+    if (fseeko (in, len, SEEK_CUR))
+      die ("%s", msg);
+    return;
+  }
+  while (len) {
+    want = len < sizeof (buf) ? len : sizeof (buf);
+    got = fread (buf, 1, want, in);
+    if (got == 0)
+      break;
+    len -= got;
+    skipped += got;
+  }
+  if (skipped == 0)
+    die ("%s", msg);
+}
+
+/* read whatever is left of IN */
+static void drain (FILE *in) {
+  unsigned char buf[4096];
+
+  if (input_size >= 0 && ftello (in) >= 0 && !fseeko (in, 0, SEEK_END))
+    return;
+  while (fread (buf, 1, sizeof (buf), in))
+    ;
+}
+
+/* the end of a key packet (of PACKETLEN octets, READBYTES of which
+   have been read): skip the rest of it, if there is any.  a streamed
+   body is drained by packetwalk() anyway. */
+static void skip_rest (FILE *in, size_t packetlen, size_t readbytes) {
+  if (packetlen != PACKET_LENGTH_STREAMED && readbytes < packetlen)
+    skip_or_die (in, packetlen - readbytes, "Could not skip past this packet.\n");
+}
+
+static unsigned int read_be (const unsigned char *buf, size_t len) {
+  unsigned int ret = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    ret = (ret << 8) | buf[i];
+  return ret;
+}
+
+static void der_reserve (struct der *d, size_t more) {
+  unsigned char *n;
+  size_t alloc = d->alloc ? d->alloc : 1024;
+
+  if (d->len + more <= d->alloc)
+    return;
+  while (alloc < d->len + more)
+    alloc *= 2;
+  n = d->secret ? gcry_malloc_secure (alloc) : gcry_malloc (alloc);
+  if (!n)
+    die ("out of memory\n");
+  if (d->buf) {
+    memcpy (n, d->buf, d->len);
+    memset (d->buf, 0, d->alloc);
+    gcry_free (d->buf);
+  }
+  d->buf = n;
+  d->alloc = alloc;
+}
+
+static void der_put (struct der *d, const void *data, size_t len) {
+  der_reserve (d, len);
+  memcpy (d->buf + d->len, data, len);
+  d->len += len;
+}
+
+/* a string in an OpenSSH public key blob */
+static void ssh_string (struct der *d, const void *data, size_t len) {
+  unsigned char hdr[4];
+
+  hdr[0] = len >> 24;
+  hdr[1] = len >> 16;
+  hdr[2] = len >> 8;
+  hdr[3] = len;
+  der_put (d, hdr, 4);
+  der_put (d, data, len);
+}
+
+/* an OpenPGP MPI (RFC 4880 section 3.2), whose bytes are also
+   appended to RAW, if that is not NULL */
+static gcry_mpi_t read_mpi (FILE *in, size_t *readtally, int secret, struct der *raw) {
+  unsigned char lenbuf[2], *body;
+  size_t bitlen, bytes, got = 0;
+  gcry_mpi_t ret;
+
+  got = read_or_die (in, lenbuf, 2, "could not read MPI length.\n");
+  bitlen = got == 2 ? read_be (lenbuf, 2) : 0;
+  *readtally += 2;
+  if (raw)
+    der_put (raw, lenbuf, got);
+
+  bytes = (bitlen + 7) / 8;
+  body = secret ? gcry_malloc_secure (bytes ? bytes : 1) : gcry_malloc (bytes ? bytes : 1);
+  if (!body)
+    die ("out of memory\n");
+  got = read_or_die (in, body, bytes, "could not read MPI body.\n");
+  *readtally += bytes;
+  if (raw)
+    der_put (raw, body, got);
+  if (gcry_mpi_scan (&ret, GCRYMPI_FMT_USG, body, got, NULL))
+    die ("could not read MPI body.\n");
+  if (secret)
+    memset (body, 0, bytes);
+  gcry_free (body);
+  return ret;
+}
+
+/* the V4 fingerprint (RFC 4880 section 12.2) of the public key
+   material in PUB, just as it appeared in the packet, as 40 upper-case
+   hex digits */
+static void fingerprint_raw (const unsigned char *pub, size_t len, unsigned char out[FPR_LENGTH]) {
+  unsigned char head[3] = { 0x99, len >> 8, len & 0xff };
+  gcry_md_hd_t md;
+
+  if (gcry_md_open (&md, GCRY_MD_SHA1, 0))
+    die ("could not hash the key\n");
+  gcry_md_write (md, head, sizeof (head));
+  gcry_md_write (md, pub, len);
+  memcpy (out, gcry_md_read (md, GCRY_MD_SHA1), FPR_LENGTH);
+  gcry_md_close (md);
+}
+
+static void fingerprint (const struct der *pub, char out[FPR_HEX_LENGTH + 1]) {
+  unsigned char digest[FPR_LENGTH];
+  size_t i;
+
+  fingerprint_raw (pub->buf, pub->len, digest);
+  for (i = 0; i < sizeof (digest); i++)
+    sprintf (out + 2 * i, "%02X", digest[i]);
+}
+
+static size_t fpr_slot (const struct fpr_set *set, const char *fpr) {
+  char head[9];
+  size_t i;
+
+  /* the fingerprint is a hash already */
+  memcpy (head, fpr, 8);
+  head[8] = '\0';
+  i = strtoul (head, NULL, 16);
+
+  for (i &= set->alloc - 1; set->slots[i][0]; i = (i + 1) & (set->alloc - 1))
+    if (!strcmp (set->slots[i], fpr))
+      break;
+  return i;
+}
+
+/* add FPR to SET, returning 0 if it was already there */
+static int fpr_set_add (struct fpr_set *set, const char *fpr) {
+  struct fpr_set grown;
+  size_t i;
+
+  if (2 * (set->n + 1) > set->alloc) {
+    grown.alloc = set->alloc ? 2 * set->alloc : 256;
+    grown.n = set->n;
+    grown.slots = calloc (grown.alloc, sizeof (*grown.slots));
+    if (!grown.slots)
+      die ("out of memory\n");
+    for (i = 0; i < set->alloc; i++)
+      if (set->slots[i][0])
+        strcpy (grown.slots[fpr_slot (&grown, set->slots[i])], set->slots[i]);
+    free (set->slots);
+    *set = grown;
+  }
+  i = fpr_slot (set, fpr);
+  if (set->slots[i][0])
+    return 0;
+  strcpy (set->slots[i], fpr);
+  set->n++;
+  return 1;
+}
+
+static void release_key (struct rsa_key *k) {
+  gcry_mpi_release (k->n);
+  gcry_mpi_release (k->e);
+  gcry_mpi_release (k->d);
+  gcry_mpi_release (k->p);
+  gcry_mpi_release (k->q);
+  gcry_free (k->sshblob.buf);
+  memset (k, 0, sizeof (*k));
+}
+
+/* what OpenSSL's RSA_check_key() (which the Perl version uses) looks
+   at: p and q are prime, n = pq, and d is an inverse of e */
+static int check_key (const struct rsa_key *k) {
+  gcry_mpi_t t = gcry_mpi_snew (0), p1 = gcry_mpi_snew (0), q1 = gcry_mpi_snew (0);
+  gcry_mpi_t lambda = gcry_mpi_snew (0), g = gcry_mpi_snew (0);
+  int ok = 0;
+
+  if (gcry_prime_check (k->p, 0) || gcry_prime_check (k->q, 0))
+    goto out;
+  gcry_mpi_mul (t, k->p, k->q);
+  if (gcry_mpi_cmp (t, k->n))
+    goto out;
+  gcry_mpi_sub_ui (p1, k->p, 1);
+  gcry_mpi_sub_ui (q1, k->q, 1);
+  gcry_mpi_gcd (g, p1, q1);
+  gcry_mpi_mul (lambda, p1, q1);
+  gcry_mpi_div (lambda, NULL, lambda, g, 0);
+  gcry_mpi_mulm (t, k->d, k->e, lambda);
+  ok = !gcry_mpi_cmp_ui (t, 1);
+ out:
+  gcry_mpi_release (t);
+  gcry_mpi_release (p1);
+  gcry_mpi_release (q1);
+  gcry_mpi_release (lambda);
+  gcry_mpi_release (g);
+  return ok;
+}
+
+/* the public part of a key packet has been read (and its fingerprint
+   is FPR): print it, for openpgp2ssh --all, or keep it (taking it from
+   K) if it is the one we are looking for */
+static void found_key (struct search *s, const char *fpr, struct rsa_key *k) {
+  size_t fprlen = s->fpr ? strlen (s->fpr) : 0;
+
+  s->current_key_match = 0;
+  if (s->all) {
+    if (fpr_set_add (&s->seen, fpr)) {
+      printf ("%s\t", fpr);
+      put_ssh (k);
+      s->found = 1;
+    }
+  } else if (!s->fpr ||
+             (fprlen <= FPR_HEX_LENGTH && !strcmp (fpr + FPR_HEX_LENGTH - fprlen, s->fpr))) {
+    if (s->found)
+      die ("Found two matching keys.\n");
+    s->found = 1;
+    s->key = *k;
+    memset (k, 0, sizeof (*k));
+    s->current_key_match = 1;
+  }
+}
+
+/* the rest of findkey(), for the public part of an ECDSA or EdDSA key
+   (see RFC 6637 section 9), as the Perl findeckey() does */
+static void findeckey (struct search *s, FILE *in, unsigned int algo, size_t packetlen,
+                       size_t readbytes) {
+  unsigned char oid[255];
+  size_t oidlen, got, mark, qlen, i;
+  const unsigned char *q;
+  const struct ssh_curve *curve = NULL;
+  struct rsa_key k = { .ssh = NULL };
+  char fpr[FPR_HEX_LENGTH + 1];
+  struct der *pub = &s->pub;
+
+  s->current_key_match = 0;
+  read_or_die (in, oid, 1, "could not read curve OID length.\n");
+  readbytes += 1;
+  der_put (pub, oid, 1);
+  oidlen = oid[0];
+  got = read_or_die (in, oid, oidlen, "could not read curve OID.\n");
+  readbytes += oidlen;
+  der_put (pub, oid, got);
+  for (i = 0; i < sizeof (ssh_curves) / sizeof (ssh_curves[0]); i++)
+    if (got == ssh_curves[i].oidlen && !memcmp (oid, ssh_curves[i].oid, got))
+      curve = ssh_curves + i;
+
+  mark = pub->len;
+  gcry_mpi_release (read_mpi (in, &readbytes, 0, pub));
+  /* read_mpi() has died unless it got the length and some body */
+  q = pub->buf + mark + 2;
+  qlen = pub->len - mark - 2;
+
+  if (!curve || curve->algo != algo || qlen != curve->qlen || q[0] != curve->prefix) {
+    fprintf (stderr, "We only support Ed25519, NIST P-256, P-384 and P-521 elliptic curve keys (this key used algorithm %u).\n", algo);
+  } else {
+    k.ssh = curve->type;
+    ssh_string (&k.sshblob, curve->type, strlen (curve->type));
+    if (algo == ALGO_EDDSA) {
+      ssh_string (&k.sshblob, q + 1, qlen - 1);
+    } else {
+      ssh_string (&k.sshblob, curve->curve, strlen (curve->curve));
+      ssh_string (&k.sshblob, q, qlen);
+    }
+    fingerprint (pub, fpr);
+    found_key (s, fpr, &k);
+    release_key (&k);
+  }
+
+  skip_rest (in, packetlen, readbytes);
+}
+
+/* handle one key packet (of TAG, PACKETLEN octets), as the Perl
+   findkey() does */
+static void findkey (struct search *s, FILE *in, int tag, size_t packetlen) {
+  unsigned char buf[4];
+  size_t readbytes = 0, got;
+  unsigned int version, algo, s2k;
+  gcry_mpi_t u;
+  struct rsa_key k = { .ssh = NULL };
+  char fpr[FPR_HEX_LENGTH + 1];
+  struct der *pub = &s->pub;
+
+  pub->len = 0;
+  read_or_die (in, buf, 1, "could not read key version\n");
+  readbytes += 1;
+  version = buf[0];
+  der_put (pub, buf, 1);
+  if (version != 4) {
+    fprintf (stderr, "We only work with version 4 keys.  This key appears to be version %u.\n",
+             version);
+    skip_or_die (in, packetlen - readbytes, "Could not skip past this packet.\n");
+    return;
+  }
+
+  got = read_or_die (in, buf, 4, "could not read key timestamp.\n");
+  readbytes += 4;
+  der_put (pub, buf, got);
+
+  read_or_die (in, buf, 1, "could not read key algorithm.\n");
+  readbytes += 1;
+  algo = buf[0];
+  der_put (pub, buf, 1);
+  if ((algo == ALGO_ECDSA || algo == ALGO_EDDSA) && s->ssh &&
+      ((tag != PKT_SECKEY && tag != PKT_SEC_SUBKEY) || s->all)) {
+    findeckey (s, in, algo, packetlen, readbytes);
+    return;
+  }
+  if (algo != ALGO_RSA) {
+    fprintf (stderr, "We only support RSA keys (this key used algorithm %u).\n", algo);
+    skip_or_die (in, packetlen - readbytes, "Could not skip past this packet.\n");
+    return;
+  }
+
+  k.n = read_mpi (in, &readbytes, 0, pub);
+  k.e = read_mpi (in, &readbytes, 0, pub);
+  fingerprint (pub, fpr);
+  /* with --all, only the public half is wanted, even of a secret key */
+  found_key (s, fpr, &k);
+  release_key (&k);
+
+  if ((tag != PKT_SECKEY && tag != PKT_SEC_SUBKEY) || !s->current_key_match) {
+    skip_rest (in, packetlen, readbytes);
+    return;
+  }
+
+  read_or_die (in, buf, 1, "Could not read S2K octet.\n");
+  readbytes += 1;
+  s2k = buf[0];
+  if (s2k != 0) {
+    fprintf (stderr, "We cannot handle encrypted secret keys.  Skipping!\n");
+    skip_or_die (in, packetlen - readbytes, "Could not skip past this packet.\n");
+    return;
+  }
+
+  /* secret material is unencrypted
+     see https://tools.ietf.org/html/rfc4880#section-5.5.3 */
+  s->key.d = read_mpi (in, &readbytes, 1, NULL);
+  s->key.p = read_mpi (in, &readbytes, 1, NULL);
+  s->key.q = read_mpi (in, &readbytes, 1, NULL);
+  u = read_mpi (in, &readbytes, 1, NULL);
+  gcry_mpi_release (u);
+
+  read_or_die (in, buf, 2, "Could not read checksum of secret key material.\n");
+  readbytes += 2;
+
+  s->key.secret = 1;
+  if (!check_key (&s->key))
+    die ("Secret key is not a valid RSA key.\n");
+
+  skip_rest (in, packetlen, readbytes);
+}
+
+/* the body of a packet with partial body lengths (RFC 4880 section
+   4.2.2.4), as a stream of its own: only the length of the current
+   chunk is kept, never the chunk itself, however big the packet */
+struct partial_body {
+  FILE *in;
+  size_t left; /* in the current chunk */
+  int more; /* whether another chunk follows this one */
+};
+
+static ssize_t partial_body_read (void *cookie, char *buf, size_t size) {
+  struct partial_body *b = cookie;
+  unsigned char len[4];
+  int c;
+  size_t got;
+
+  while (b->left == 0 && b->more) {
+    /* a truncated length ends the body, as the end of the input does */
+    b->more = 0;
+    if ((c = getc (b->in)) == EOF)
+      break;
+    if (c < 192) {
+      b->left = c;
+    } else if (c < 224) {
+      if (fread (len, 1, 1, b->in) == 1)
+        b->left = ((c - 192) << 8) + len[0] + 192;
+    } else if (c == 255) {
+      if (fread (len, 1, 4, b->in) == 4)
+        b->left = read_be (len, 4);
+    } else {
+      b->left = (size_t)1 << (c & 0x1f);
+      b->more = 1;
+    }
+  }
+  if (size > b->left)
+    size = b->left;
+  got = size ? fread (buf, 1, size, b->in) : 0;
+  if (got < size)
+    b->more = 0;
+  b->left = got < size ? 0 : b->left - got;
+  return got;
+}
+
+/* walk the OpenPGP packets on IN, handing key packets to findkey() */
+static void packetwalk (FILE *in, struct search *s) {
+  static const cookie_io_functions_t partial_body_io = { .read = partial_body_read };
+  struct partial_body body;
+  unsigned char buf[4];
+  int c, tag, packettag, nextlen;
+  size_t packetlen = 0;
+  int have_len, partial, indeterminate;
+  FILE *f;
+
+  while ((c = getc (in)) != EOF) {
+    packettag = c;
+    have_len = 1;
+    partial = indeterminate = 0;
+    if (!(0x80 & packettag))
+      die ("This is not an OpenPGP packet\n");
+    if (0x40 & packettag) {
+      /* this is a new-format packet. */
+      tag = 0x3f & packettag;
+      nextlen = getc (in);
+      if (nextlen == EOF)
+        nextlen = 0;
+      if (nextlen < 192) {
+        packetlen = nextlen;
+      } else if (nextlen < 224) {
+        c = getc (in);
+        packetlen = ((nextlen - 192) << 8) + (c == EOF ? 0 : c) + 192;
+      } else if (nextlen == 255) {
+        /* as with perl's unpack(), a short length is no length */
+        have_len = fread (buf, 1, 4, in) == 4;
+        packetlen = read_be (buf, 4);
+      } else {
+        /* a partial body length: the first chunk of the body */
+        packetlen = (size_t)1 << (nextlen & 0x1f);
+        partial = 1;
+      }
+    } else {
+      /* this is an old-format packet. */
+      int lentype = 0x03 & packettag;
+      tag = (0x3c & packettag) >> 2;
+      if (lentype == 3) {
+        /* the packet runs to the end of the input */
+        indeterminate = 1;
+      } else {
+        size_t n = (size_t)1 << lentype, got;
+        got = read_or_die (in, buf, n, "could not read packet length\n");
+        have_len = got == n;
+        packetlen = read_be (buf, got);
+      }
+    }
+
+    if (!have_len)
+      die ("Undefined packet lengths are not supported.\n");
+
+    if (partial || indeterminate) {
+      /* neither length is known until the end of the body */
+      f = in;
+      if (partial) {
+        body.in = in;
+        body.left = packetlen;
+        body.more = 1;
+        if (!(f = fopencookie (&body, "r", partial_body_io)))
+          die ("out of memory\n");
+      }
+      if (tag == PKT_PUBKEY || tag == PKT_PUB_SUBKEY || tag == PKT_SECKEY || tag == PKT_SEC_SUBKEY)
+        findkey (s, f, tag, PACKET_LENGTH_STREAMED);
+      drain (f);
+      if (f != in)
+        fclose (f);
+    } else if (tag == PKT_PUBKEY || tag == PKT_PUB_SUBKEY || tag == PKT_SECKEY || tag == PKT_SEC_SUBKEY) {
+      findkey (s, in, tag, packetlen);
+    } else {
+      skip_or_die (in, packetlen, "Could not skip past this packet!\n");
+    }
+  }
+}
+
+/* OPENPGP2SSH_INDEX names a sidecar index of the keyring on standard
+   input, so that looking one key up in a big keyring does not mean
+   parsing all of it.  The index is a header:
+
+     magic        "keytrans-index" and a format version (16 octets)
+     size         of the keyring (8 octets)
+     mtime        of the keyring, seconds and nanoseconds (8 + 4 octets)
+     count        of entries (4 octets)
+
+   and then COUNT entries:
+
+     fingerprint  of a key (20 octets)
+     offset       of its key packet in the keyring (8 octets)
+     length       of that packet, header included (8 octets)
+
+   all big-endian.  The entries are sorted by fingerprint read from the
+   last hex digit to the first (so that the keys whose fingerprints end
+   in a given key ID are next to each other), and then by offset.  Only
+   the key packets findkey() could match (version 4 RSA, ECDSA and EdDSA
+   keys) are listed.  A keyring whose size or modification time does
+   not match the header gets a new index.  A keyring that can't be
+   indexed (see index_build()) gets just the header, with a count of
+   INDEX_UNINDEXABLE, so that until it changes it goes straight to
+   packetwalk() without being scanned for an index first. */
+#define INDEX_MAGIC "keytrans-index\0\1"
+#define INDEX_MAGIC_SIZE 16
+#define INDEX_HEADER_SIZE (INDEX_MAGIC_SIZE + 8 + 12 + 4)
+#define INDEX_ENTRY_SIZE (FPR_LENGTH + 8 + 8)
+#define INDEX_UNINDEXABLE 0xffffffffUL
+
+static void put_be (unsigned char *buf, unsigned long long val, size_t len) {
+  while (len--) {
+    buf[len] = val & 0xff;
+    val >>= 8;
+  }
+}
+
+static unsigned long long read_be64 (const unsigned char *buf) {
+  return ((unsigned long long)read_be (buf, 4) << 32) | read_be (buf + 4, 4);
+}
+
+/* hex digit I (from 0, the first) of a binary fingerprint */
+static unsigned int fpr_nibble (const unsigned char *fpr, size_t i) {
+  return i % 2 ? fpr[i / 2] & 0x0f : fpr[i / 2] >> 4;
+}
+
+static int index_entry_cmp (const void *a, const void *b) {
+  const unsigned char *x = a, *y = b;
+  unsigned long long xo, yo;
+  size_t i;
+
+  for (i = FPR_HEX_LENGTH; i--; )
+    if (fpr_nibble (x, i) != fpr_nibble (y, i))
+      return fpr_nibble (x, i) < fpr_nibble (y, i) ? -1 : 1;
+  xo = read_be64 (x + FPR_LENGTH);
+  yo = read_be64 (y + FPR_LENGTH);
+  return xo < yo ? -1 : xo > yo;
+}
+
+/* compare the end of the fingerprint of an index entry with the
+   upper-case hex key ID (or fingerprint) HEX */
+static int index_suffix_cmp (const unsigned char *entry, const char *hex, size_t hexlen) {
+  static const char digits[] = "0123456789ABCDEF";
+  const char *d;
+  unsigned int n, q;
+  size_t i;
+
+  for (i = 0; i < hexlen; i++) {
+    n = fpr_nibble (entry, FPR_HEX_LENGTH - 1 - i);
+    d = hex[hexlen - 1 - i] ? strchr (digits, hex[hexlen - 1 - i]) : NULL;
+    /* anything else sorts after every hex digit, and matches nothing */
+    q = d ? (unsigned int)(d - digits) : 16;
+    if (n != q)
+      return n < q ? -1 : 1;
+  }
+  return 0;
+}
+
+/* the length of the public key material at the start of the key
+   packet BODY (of LEN octets), which is what findkey() fingerprints.
+   returns 1 if this is a key findkey() could match, 0 if it is not,
+   and -1 if findkey() would not get through it cleanly (reading past
+   the end of it, or dying), in which case the keyring is not
+   indexed. */
+static int public_key_length (const unsigned char *body, size_t len, size_t *publen) {
+  size_t off = 6, mpis, bits;
+
+  if (len == 0)
+    return -1;
+  if (body[0] != 4)
+    return 0;
+  if (len <= 6)
+    return -1;
+  if (body[5] == ALGO_RSA) {
+    mpis = 2;
+  } else if (body[5] == ALGO_ECDSA || body[5] == ALGO_EDDSA) {
+    if (body[6] == 0 || len - 7 < body[6])
+      return -1;
+    off += 1 + body[6];
+    mpis = 1;
+  } else {
+    return 0;
+  }
+  while (mpis--) {
+    if (len - off < 2)
+      return -1;
+    bits = read_be (body + off, 2);
+    if (bits == 0 || len - off - 2 < (bits + 7) / 8)
+      return -1;
+    off += 2 + (bits + 7) / 8;
+  }
+  *publen = off;
+  return 1;
+}
+
+/* fill in the header of IDX, for a keyring of SIZE octets last
+   modified at MTIME */
+static void index_header (struct der *idx, size_t size, const struct timespec *mtime,
+                          unsigned long count) {
+  put_be (idx->buf + INDEX_MAGIC_SIZE, size, 8);
+  put_be (idx->buf + INDEX_MAGIC_SIZE + 8, mtime->tv_sec, 8);
+  put_be (idx->buf + INDEX_MAGIC_SIZE + 16, mtime->tv_nsec, 4);
+  put_be (idx->buf + INDEX_MAGIC_SIZE + 20, count, 4);
+}
+
+/* build the index of the keyring MAP (of SIZE octets, last modified
+   at MTIME) into IDX.  returns 0, or -1 if the keyring is not one
+   packetwalk() would get through cleanly, or has packets with partial
+   or indeterminate lengths, so it is left to packetwalk(). */
+static int index_build (struct der *idx, const unsigned char *map, size_t size,
+                        const struct timespec *mtime) {
+  unsigned char entry[INDEX_ENTRY_SIZE];
+  size_t off = 0, hlen, blen, publen, count = 0;
+  int tag, lentype, candidate;
+
+  idx->len = 0;
+  der_put (idx, INDEX_MAGIC, INDEX_MAGIC_SIZE);
+  der_reserve (idx, INDEX_HEADER_SIZE - INDEX_MAGIC_SIZE);
+  idx->len = INDEX_HEADER_SIZE;
+
+  while (off < size) {
+    /* see RFC 4880 section 4.2, and packetwalk() */
+    if (!(map[off] & 0x80))
+      return -1;
+    if (map[off] & 0x40) {
+      tag = map[off] & 0x3f;
+      if (size - off < 2)
+        return -1;
+      if (map[off + 1] < 192) {
+        hlen = 2;
+        blen = map[off + 1];
+      } else if (map[off + 1] < 224) {
+        hlen = 3;
+        if (size - off < 3)
+          return -1;
+        blen = ((map[off + 1] - 192) << 8) + map[off + 2] + 192;
+      } else if (map[off + 1] == 255) {
+        hlen = 6;
+        if (size - off < 6)
+          return -1;
+        blen = read_be (map + off + 2, 4);
+      } else {
+        return -1;
+      }
+    } else {
+      tag = (map[off] & 0x3c) >> 2;
+      lentype = map[off] & 0x03;
+      if (lentype == 3)
+        return -1;
+      hlen = 1 + ((size_t)1 << lentype);
+      if (size - off < hlen)
+        return -1;
+      blen = read_be (map + off + 1, hlen - 1);
+    }
+    if (size - off - hlen < blen)
+      return -1;
+
+    if (tag == PKT_PUBKEY || tag == PKT_PUB_SUBKEY || tag == PKT_SECKEY || tag == PKT_SEC_SUBKEY) {
+      candidate = public_key_length (map + off + hlen, blen, &publen);
+      if (candidate < 0)
+        return -1;
+      if (candidate) {
+        fingerprint_raw (map + off + hlen, publen, entry);
+        put_be (entry + FPR_LENGTH, off, 8);
+        put_be (entry + FPR_LENGTH + 8, hlen + blen, 8);
+        der_put (idx, entry, sizeof (entry));
+        count++;
+      }
+    } else if (blen == 0) {
+      /* packetwalk() cannot skip an empty packet */
+      return -1;
+    }
+    off += hlen + blen;
+  }
+
+  qsort (idx->buf + INDEX_HEADER_SIZE, count, INDEX_ENTRY_SIZE, index_entry_cmp);
+  index_header (idx, size, mtime, count);
+  return 0;
+}
+
+/* is IDX (of LEN octets) an index of a keyring of SIZE octets, last
+   modified at MTIME?  returns 1 if so, -1 if it says that keyring
+   can't be indexed, and 0 if it is out of date (or not an index). */
+static int index_current (const unsigned char *idx, size_t len, size_t size,
+                          const struct timespec *mtime) {
+  unsigned long count;
+
+  if (len < INDEX_HEADER_SIZE ||
+      memcmp (idx, INDEX_MAGIC, INDEX_MAGIC_SIZE) ||
+      read_be64 (idx + INDEX_MAGIC_SIZE) != size ||
+      read_be64 (idx + INDEX_MAGIC_SIZE + 8) != (unsigned long long)mtime->tv_sec ||
+      read_be (idx + INDEX_MAGIC_SIZE + 16, 4) != (unsigned long)mtime->tv_nsec)
+    return 0;
+  count = read_be (idx + INDEX_MAGIC_SIZE + 20, 4);
+  if (count == INDEX_UNINDEXABLE)
+    return len == INDEX_HEADER_SIZE ? -1 : 0;
+  return (len - INDEX_HEADER_SIZE) / INDEX_ENTRY_SIZE == count &&
+    (len - INDEX_HEADER_SIZE) % INDEX_ENTRY_SIZE == 0;
+}
+
+/* replace the index at PATH with IDX.  it is only a cache, so failing
+   to (a read-only directory, say) is not worth a word: the keyring is
+   just walked instead. */
+static void index_write (const char *path, const struct der *idx) {
+  char *tmp;
+  int fd;
+
+  if (asprintf (&tmp, "%s.XXXXXX", path) < 0)
+    return;
+  if ((fd = mkstemp (tmp)) < 0 ||
+      write (fd, idx->buf, idx->len) != (ssize_t)idx->len ||
+      close (fd) ||
+      rename (tmp, path)) {
+    if (fd >= 0)
+      unlink (tmp);
+  }
+  free (tmp);
+}
+
+/* look S->fpr up in the keyring on standard input (described by ST)
+   through the index at PATH (rebuilding that if it is out of date),
+   and hand just the candidate key packets to packetwalk().  returns 0
+   if the index could not be used, and the keyring has to be walked
+   after all. */
+static int index_walk (struct search *s, const char *path, const struct stat *st) {
+  struct der built = { .secret = 0 };
+  const unsigned char *map, *idx = NULL, *e;
+  void *idxmap = MAP_FAILED;
+  size_t size = st->st_size, idxlen = 0, lo, hi, mid, first, n, fprlen = strlen (s->fpr);
+  unsigned long long off, len;
+  struct stat ist;
+  FILE *f;
+  int fd, current = 0, ret = 0;
+
+  map = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fileno (stdin), 0);
+  if (map == MAP_FAILED)
+    return 0;
+  if ((fd = open (path, O_RDONLY)) >= 0) {
+    if (!fstat (fd, &ist) && ist.st_size > 0 &&
+        (idxmap = mmap (NULL, ist.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED)
+      current = index_current (idxmap, ist.st_size, size, &st->st_mtim);
+    close (fd);
+  }
+  if (current < 0)
+    goto out;
+  if (current) {
+    idx = idxmap;
+    idxlen = ist.st_size;
+  } else {
+    if (index_build (&built, map, size, &st->st_mtim)) {
+      /* don't try again until the keyring changes */
+      built.len = INDEX_HEADER_SIZE;
+      index_header (&built, size, &st->st_mtim, INDEX_UNINDEXABLE);
+      index_write (path, &built);
+      goto out;
+    }
+    index_write (path, &built);
+    idx = built.buf;
+    idxlen = built.len;
+  }
+
+  /* the first entry not before the key ID, and then every entry that
+     ends in it */
+  n = (idxlen - INDEX_HEADER_SIZE) / INDEX_ENTRY_SIZE;
+  lo = 0;
+  hi = n;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (index_suffix_cmp (idx + INDEX_HEADER_SIZE + mid * INDEX_ENTRY_SIZE, s->fpr, fprlen) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  first = lo;
+  for (hi = first; hi < n && fprlen <= FPR_HEX_LENGTH; hi++) {
+    e = idx + INDEX_HEADER_SIZE + hi * INDEX_ENTRY_SIZE;
+    if (index_suffix_cmp (e, s->fpr, fprlen))
+      break;
+    off = read_be64 (e + FPR_LENGTH);
+    len = read_be64 (e + FPR_LENGTH + 8);
+    if (off > size || len > size - off || len == 0)
+      goto out;
+  }
+
+  for (; first < hi; first++) {
+    e = idx + INDEX_HEADER_SIZE + first * INDEX_ENTRY_SIZE;
+    off = read_be64 (e + FPR_LENGTH);
+    len = read_be64 (e + FPR_LENGTH + 8);
+    if (!(f = fmemopen ((void *)(map + off), len, "r")))
+      die ("could not read the keyring\n");
+    input_size = len;
+    packetwalk (f, s);
+    fclose (f);
+  }
+  ret = 1;
+ out:
+  if (idxmap != MAP_FAILED)
+    munmap (idxmap, ist.st_size);
+  munmap ((void *)map, size);
+  gcry_free (built.buf);
+  return ret;
+}
+
+static void der_header (struct der *d, unsigned char tag, size_t len) {
+  unsigned char h[6];
+  size_t hl = 0, i;
+
+  h[hl++] = tag;
+  if (len < 0x80) {
+    h[hl++] = len;
+  } else {
+    size_t n = 0;
+    for (i = len; i; i >>= 8)
+      n++;
+    h[hl++] = 0x80 | n;
+    for (i = n; i; i--)
+      h[hl++] = len >> (8 * (i - 1));
+  }
+  der_put (d, h, hl);
+}
+
+/* a non-negative INTEGER, with the fewest octets that keep it
+   positive */
+static void der_integer (struct der *d, gcry_mpi_t mpi) {
+  size_t len = (gcry_mpi_get_nbits (mpi) + 7) / 8;
+  int pad = len == 0 || gcry_mpi_test_bit (mpi, len * 8 - 1);
+
+  der_header (d, 0x02, len + pad);
+  der_reserve (d, len + pad);
+  if (pad)
+    d->buf[d->len++] = 0;
+  if (len && gcry_mpi_print (GCRYMPI_FMT_USG, d->buf + d->len, len, NULL, mpi))
+    die ("could not write MPI\n");
+  d->len += len;
+}
+
+/* wrap everything in D from offset START on in a TAG */
+static void der_wrap (struct der *d, size_t start, unsigned char tag) {
+  struct der body = { .secret = d->secret };
+
+  der_put (&body, d->buf + start, d->len - start);
+  memset (d->buf + start, 0, d->len - start);
+  d->len = start;
+  der_header (d, tag, body.len);
+  der_put (d, body.buf, body.len);
+  memset (body.buf, 0, body.alloc);
+  gcry_free (body.buf);
+}
+
+static void der_rsa_public_key (struct der *d, const struct rsa_key *k) {
+  size_t start = d->len;
+
+  der_integer (d, k->n);
+  der_integer (d, k->e);
+  der_wrap (d, start, 0x30);
+}
+
+/* RFC 3447 appendix A.1.2 */
+static void der_rsa_private_key (struct der *d, const struct rsa_key *k) {
+  gcry_mpi_t zero = gcry_mpi_set_ui (NULL, 0), t = gcry_mpi_snew (0);
+  gcry_mpi_t dmp1 = gcry_mpi_snew (0), dmq1 = gcry_mpi_snew (0), iqmp = gcry_mpi_snew (0);
+  size_t start = d->len;
+
+  gcry_mpi_sub_ui (t, k->p, 1);
+  gcry_mpi_mod (dmp1, k->d, t);
+  gcry_mpi_sub_ui (t, k->q, 1);
+  gcry_mpi_mod (dmq1, k->d, t);
+  if (!gcry_mpi_invm (iqmp, k->q, k->p))
+    die ("Secret key is not a valid RSA key.\n");
+
+  der_integer (d, zero);
+  der_integer (d, k->n);
+  der_integer (d, k->e);
+  der_integer (d, k->d);
+  der_integer (d, k->p);
+  der_integer (d, k->q);
+  der_integer (d, dmp1);
+  der_integer (d, dmq1);
+  der_integer (d, iqmp);
+  der_wrap (d, start, 0x30);
+  gcry_mpi_release (zero);
+  gcry_mpi_release (t);
+  gcry_mpi_release (dmp1);
+  gcry_mpi_release (dmq1);
+  gcry_mpi_release (iqmp);
+}
+
+/* RFC 5280 section 4.1.2.7, with rsaEncryption and NULL parameters */
+static void der_spki (struct der *d, const struct rsa_key *k) {
+  static const unsigned char algid[] = {
+    0x30, 0x0d, 0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x01, 0x05, 0x00
+  };
+  size_t start = d->len, bits;
+
+  der_put (d, algid, sizeof (algid));
+  bits = d->len;
+  der_put (d, "", 1); /* no unused bits */
+  der_rsa_public_key (d, k);
+  der_wrap (d, bits, 0x03);
+  der_wrap (d, start, 0x30);
+}
+
+static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* base64, broken into lines of WIDTH (or not at all, if WIDTH is 0) */
+static void put_base64 (const unsigned char *s, size_t len, size_t width) {
+  size_t i, col = 0;
+  unsigned int v;
+  char out[4];
+
+  for (i = 0; i < len; i += 3) {
+    v = s[i] << 16;
+    if (i + 1 < len)
+      v |= s[i + 1] << 8;
+    if (i + 2 < len)
+      v |= s[i + 2];
+    out[0] = b64[(v >> 18) & 0x3f];
+    out[1] = b64[(v >> 12) & 0x3f];
+    out[2] = i + 1 < len ? b64[(v >> 6) & 0x3f] : '=';
+    out[3] = i + 2 < len ? b64[v & 0x3f] : '=';
+    fwrite (out, 1, 4, stdout);
+    col += 4;
+    if (width && col >= width) {
+      putchar ('\n');
+      col = 0;
+    }
+  }
+  if (width && col)
+    putchar ('\n');
+}
+
+/* PEM, as OpenSSL writes it */
+static void put_pem (const char *label, const struct der *d) {
+  printf ("-----BEGIN %s-----\n", label);
+  put_base64 (d->buf, d->len, 64);
+  printf ("-----END %s-----\n", label);
+}
+
+/* an mpint or string for an OpenSSH public key line, with a leading
+   zero when the high bit is set (as the Perl openssh_mpi_pack()) */
+static void ssh_mpi (struct der *d, const unsigned char *val, size_t len) {
+  unsigned char hdr[5];
+  int pad = len && (val[0] & 0x80);
+  size_t l = len + pad;
+
+  hdr[0] = l >> 24;
+  hdr[1] = l >> 16;
+  hdr[2] = l >> 8;
+  hdr[3] = l;
+  hdr[4] = 0;
+  der_put (d, hdr, 4 + pad);
+  der_put (d, val, len);
+}
+
+static void put_ssh (const struct rsa_key *k) {
+  struct der d = { .secret = 0 };
+  unsigned char *buf;
+  size_t len;
+  gcry_mpi_t mpis[2] = { k->e, k->n };
+  int i;
+
+  if (k->ssh) {
+    printf ("%s ", k->ssh);
+    put_base64 (k->sshblob.buf, k->sshblob.len, 0);
+    printf ("\n");
+    return;
+  }
+  ssh_mpi (&d, (const unsigned char *)"ssh-rsa", 7);
+  for (i = 0; i < 2; i++) {
+    if (gcry_mpi_aprint (GCRYMPI_FMT_USG, &buf, &len, mpis[i]))
+      die ("could not write MPI\n");
+    /* gcrypt gives a single zero octet for 0; Bignum gives nothing */
+    ssh_mpi (&d, buf, gcry_mpi_get_nbits (mpis[i]) ? len : 0);
+    gcry_free (buf);
+  }
+  printf ("ssh-rsa ");
+  put_base64 (d.buf, d.len, 0);
+  printf ("\n");
+  gcry_free (d.buf);
+}
+
+static void find_rsa_key (struct search *s, const char *fpr, int ssh, int all, char **upper,
+                          const char *index, const struct stat *st) {
+  size_t i;
+
+  memset (s, 0, sizeof (*s));
+  s->ssh = ssh;
+  s->all = all;
+  if (fpr && !all) {
+    if (strlen (fpr) < 8)
+      die ("We need at least 8 hex digits of fingerprint.\n");
+    *upper = strdup (fpr);
+    if (!*upper)
+      die ("out of memory\n");
+    for (i = 0; (*upper)[i]; i++)
+      (*upper)[i] = toupper ((unsigned char)(*upper)[i]);
+    s->fpr = *upper;
+  }
+  if (!(index && *index && s->fpr && input_size > 0 && index_walk (s, index, st)))
+    packetwalk (stdin, s);
+  if (!s->found)
+    die ("No matching key found.\n");
+}
+
+int main (int argc, char *argv[]) {
+  struct search s;
+  struct der d = { .secret = 1 };
+  char *upper = NULL;
+  struct stat st;
+  char *name = basename (argv[0]);
+  const char *fpr = argc > 1 ? argv[1] : NULL;
+  enum { to_ssh, to_pem, to_spki } mode;
+
+  if (!strcmp (name, "openpgp2ssh"))
+    mode = to_ssh;
+  else if (!strcmp (name, "openpgp2pem"))
+    mode = to_pem;
+  else if (!strcmp (name, "openpgp2spki"))
+    mode = to_spki;
+  else if (!strcmp (name, "pem2openpgp"))
+    die ("pem2openpgp is only implemented by the Perl keytrans.\n");
+  else if (!strcmp (name, "keytrans") || !strcmp (name, "keytrans-native"))
+    die ("Unrecognized subcommand.  keytrans subcommands are not a stable interface!\n");
+  else
+    die ("Unrecognized keytrans call.\n");
+
+  if (!gcry_check_version (GCRYPT_VERSION))
+    die ("libgcrypt version mismatch\n");
+  gcry_control (GCRYCTL_INIT_SECMEM, 64 * 1024, 0);
+  gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+
+  if (!fstat (fileno (stdin), &st) && S_ISREG (st.st_mode))
+    input_size = st.st_size;
+  setvbuf (stdin, NULL, _IOFBF, INPUT_BUFFER_SIZE);
+
+  find_rsa_key (&s, fpr, mode == to_ssh, mode == to_ssh && fpr && !strcmp (fpr, "--all"),
+                &upper, getenv ("OPENPGP2SSH_INDEX"), &st);
+  if (s.all) {
+    /* already printed */
+  } else if (mode == to_ssh && !s.key.secret) {
+    put_ssh (&s.key);
+  } else {
+    if (mode == to_spki)
+      der_spki (&d, &s.key);
+    else if (s.key.secret)
+      der_rsa_private_key (&d, &s.key);
+    else
+      der_rsa_public_key (&d, &s.key);
+    put_pem (mode == to_spki ? "PUBLIC KEY" :
+             s.key.secret ? "RSA PRIVATE KEY" : "RSA PUBLIC KEY", &d);
+  }
+  if (d.buf) {
+    memset (d.buf, 0, d.alloc);
+    gcry_free (d.buf);
+  }
+  release_key (&s.key);
+  free (s.seen.slots);
+  gcry_free (s.pub.buf);
+  free (upper);
+  return fflush (stdout) ? 1 : 0;
+}
@@ -0,0 +1,140 @@
+/* agent-transfer-fuzz: fuzzing entry point for agent-transfer's parsers
+   and encoders
+
+   This pulls in agent-transfer.c whole, so that its internal (static)
+   functions can be driven directly on in-memory input.  The first
+   octet of each input picks what the rest of it is fed to:
+
+     0  an unwrapped secret key, as gpg-agent's EXPORT_KEY gives it:
+        parse_key(), then ssh_encode_add_identity() and
+        ssh_encode_openssh_key() if it parsed
+     1  a public key, as gpg-agent's READKEY gives it: ssh_pubkey_blob()
+     2  an ssh-agent response to REQUEST_IDENTITIES: identities_cb()
+
+   Built with -DAGENT_TRANSFER_LIBFUZZER and -fsanitize=fuzzer (see
+   "make fuzz"), libFuzzer drives LLVMFuzzerTestOneInput().  Otherwise
+   the main() below runs each file named on the command line through
+   it, or standard input if there are none, which is what AFL (or a
+   crash reproducer) wants.  tests/agent-transfer-microbench -o DIR
+   writes a seed corpus. */
+
+#include "../src/agent-transfer/agent-transfer.c"
+
+#include <stdint.h>
+
+int LLVMFuzzerTestOneInput (const uint8_t *data, size_t size);
+
+static struct exporter fuzz_e;
+
+static void fuzz_setup (void) {
+  if (fuzz_e.arena)
+    return;
+  if (!gcry_check_version (GCRYPT_VERSION))
+    abort ();
+  gcry_control (GCRYCTL_INIT_SECMEM, SECMEM_POOL_BASE, 0);
+  gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+  fuzz_e.arena = gcry_calloc_secure (2, KEY_ARENA_HALF);
+  if (!fuzz_e.arena)
+    abort ();
+  fuzz_e.wrapped_key = fuzz_e.arena;
+  fuzz_e.unwrapped_key = fuzz_e.arena + KEY_ARENA_HALF;
+}
+
+static void fuzz_secret_key (const uint8_t *data, size_t size) {
+  struct ssh_encoder enc = { .buf = NULL };
+
+  if (size > KEY_ARENA_HALF)
+    return;
+  memcpy (fuzz_e.unwrapped_key, data, size);
+  fuzz_e.unwrapped_len = size;
+  if (!parse_key (&fuzz_e)) {
+    /* the encoders check that they wrote exactly what they sized */
+    if (ssh_encode_add_identity (&enc, &fuzz_e, 60, 1, "fuzz") ||
+        ssh_encode_openssh_key (&enc, &fuzz_e, "fuzz"))
+      abort ();
+  }
+  ssh_encoder_release (&enc);
+  reset_exporter_key (&fuzz_e);
+}
+
+static void fuzz_public_key (const uint8_t *data, size_t size) {
+  unsigned char *blob;
+  size_t bloblen;
+
+  if (!ssh_pubkey_blob (data, size, &blob, &bloblen))
+    free (blob);
+}
+
+static void fuzz_identities (const uint8_t *data, size_t size) {
+  struct identity_list ids = { .n = 0 };
+  struct ssh_agents agents = { .ids = &ids, .n = 1 };
+
+  identities_cb (&agents, NULL, 0, data, size);
+  identity_list_has (&ids, data, size);
+  identity_list_release (&ids);
+}
+
+int LLVMFuzzerTestOneInput (const uint8_t *data, size_t size) {
+  fuzz_setup ();
+  if (size < 1)
+    return 0;
+  switch (data[0]) {
+  case 0:
+    fuzz_secret_key (data + 1, size - 1);
+    break;
+  case 1:
+    fuzz_public_key (data + 1, size - 1);
+    break;
+  case 2:
+    fuzz_identities (data + 1, size - 1);
+    break;
+  }
+  return 0;
+}
+
+#ifndef AGENT_TRANSFER_LIBFUZZER
+static int fuzz_file (FILE *f, const char *name) {
+  unsigned char *buf = NULL, *n;
+  size_t len = 0, alloc = 0, r;
+
+  do {
+    if (len == alloc) {
+      alloc = alloc ? alloc * 2 : 65536;
+      if (!(n = realloc (buf, alloc))) {
+        fprintf (stderr, "%s: out of memory\n", name);
+        free (buf);
+        return 1;
+      }
+      buf = n;
+    }
+    r = fread (buf + len, 1, alloc - len, f);
+    len += r;
+  } while (r);
+  if (ferror (f)) {
+    fprintf (stderr, "%s: read error\n", name);
+    free (buf);
+    return 1;
+  }
+  LLVMFuzzerTestOneInput (buf, len);
+  free (buf);
+  return 0;
+}
+
+int main (int argc, char *argv[]) {
+  FILE *f;
+  int i, ret = 0;
+
+  if (argc < 2)
+    return fuzz_file (stdin, "stdin");
+  for (i = 1; i < argc; i++) {
+    if (!(f = fopen (argv[i], "rb"))) {
+      perror (argv[i]);
+      ret = 1;
+      continue;
+    }
+    ret |= fuzz_file (f, argv[i]);
+    fclose (f);
+  }
+  return ret;
+}
+#endif
@@ -0,0 +1,239 @@
+/* agent-transfer-microbench: time agent-transfer's per-key work in
+   isolation
+
+   Like tests/agent-transfer-fuzz, this pulls in agent-transfer.c
+   whole.  It generates an RSA and an Ed25519 key, wraps them the way
+   gpg-agent does, and then times, per key type, with no agents or
+   sockets involved:
+
+     unwrap   AESWRAP decryption and parse_key()
+     encode   ssh_encode_add_identity()
+     openssh  ssh_encode_openssh_key()
+     pubkey   ssh_pubkey_blob() on the READKEY form
+
+   Usage: agent-transfer-microbench [-n ITERATIONS] [-b RSA-BITS] [-o DIR]
+
+   With -o, it also writes a seed corpus for tests/agent-transfer-fuzz
+   into DIR (which must exist). */
+
+#include "../src/agent-transfer/agent-transfer.c"
+
+struct bench_key {
+  const char *name;
+  unsigned char *wrapped;
+  size_t wrapped_len;
+  unsigned char *sec; /* unwrapped, unpadded */
+  size_t sec_len;
+  unsigned char *pub;
+  size_t pub_len;
+};
+
+static void die (const char *what, gpg_error_t err) {
+  fprintf (stderr, "agent-transfer-microbench: %s: %s\n", what, gpg_strerror (err));
+  exit (1);
+}
+
+static unsigned char *canon (gcry_sexp_t sexp, size_t *len) {
+  size_t n = gcry_sexp_sprint (sexp, GCRYSEXP_FMT_CANON, NULL, 0);
+  unsigned char *buf = gcry_calloc_secure (1, n + 8);
+
+  if (!buf)
+    die ("allocating a key", gpg_error_from_syserror ());
+  gcry_sexp_sprint (sexp, GCRYSEXP_FMT_CANON, buf, n);
+  /* gcry_sexp_sprint counts the terminating NUL it adds */
+  *len = n - 1;
+  return buf;
+}
+
+static void make_key (struct bench_key *k, const char *name, const char *genkey,
+                      gcry_cipher_hd_t wrap) {
+  gcry_sexp_t parms, keypair, pub, sec;
+  size_t padded;
+  gpg_error_t err;
+
+  k->name = name;
+  if ((err = gcry_sexp_new (&parms, genkey, 0, 1)) ||
+      (err = gcry_pk_genkey (&keypair, parms)))
+    die ("generating a key", err);
+  pub = gcry_sexp_find_token (keypair, "public-key", 0);
+  sec = gcry_sexp_find_token (keypair, "private-key", 0);
+  if (!pub || !sec)
+    die ("taking the key apart", gpg_error (GPG_ERR_INV_OBJ));
+  k->pub = canon (pub, &k->pub_len);
+  k->sec = canon (sec, &k->sec_len);
+  /* zero-padded to a multiple of 8, as gpg-agent sends it */
+  padded = (k->sec_len + 7) / 8 * 8;
+  k->wrapped_len = padded + 8;
+  if (k->wrapped_len > KEY_ARENA_HALF || !(k->wrapped = malloc (k->wrapped_len)))
+    die ("wrapping a key", gpg_error (GPG_ERR_TOO_LARGE));
+  if ((err = gcry_cipher_encrypt (wrap, k->wrapped, k->wrapped_len, k->sec, padded)))
+    die ("wrapping a key", err);
+  gcry_sexp_release (pub);
+  gcry_sexp_release (sec);
+  gcry_sexp_release (keypair);
+  gcry_sexp_release (parms);
+}
+
+static double now (void) {
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report (const char *key, const char *what, double elapsed, unsigned long n) {
+  printf ("%-8s %-8s %10.0f ns/op %12.0f ops/s\n", key, what, elapsed * 1e9 / n, n / elapsed);
+}
+
+static void bench (struct exporter *e, const struct bench_key *k, unsigned long n) {
+  struct ssh_encoder enc = { .buf = NULL };
+  unsigned char *blob;
+  size_t bloblen;
+  unsigned long i;
+  double t, unwrap = 0, encode = 0;
+  gpg_error_t err;
+
+  for (i = 0; i < n; i++) {
+    t = now ();
+    memcpy (e->wrapped_key, k->wrapped, k->wrapped_len);
+    e->wrapped_len = k->wrapped_len;
+    if ((err = unwrap_key (e)))
+      die ("unwrapping", err);
+    unwrap += now () - t;
+    t = now ();
+    if (ssh_encode_add_identity (&enc, e, 0, 0, "GnuPG keygrip 0123456789ABCDEF0123456789ABCDEF01234567"))
+      die ("encoding", gpg_error (GPG_ERR_GENERAL));
+    encode += now () - t;
+    ssh_encoder_wipe (&enc);
+    if (i + 1 < n)
+      reset_exporter_key (e);
+  }
+  report (k->name, "unwrap", unwrap, n);
+  report (k->name, "encode", encode, n);
+
+  t = now ();
+  for (i = 0; i < n; i++) {
+    if (ssh_encode_openssh_key (&enc, e, "GnuPG keygrip 0123456789ABCDEF0123456789ABCDEF01234567"))
+      die ("encoding", gpg_error (GPG_ERR_GENERAL));
+    ssh_encoder_wipe (&enc);
+  }
+  report (k->name, "openssh", now () - t, n);
+  reset_exporter_key (e);
+
+  t = now ();
+  for (i = 0; i < n; i++) {
+    if ((err = ssh_pubkey_blob (k->pub, k->pub_len, &blob, &bloblen)))
+      die ("public key", err);
+    free (blob);
+  }
+  report (k->name, "pubkey", now () - t, n);
+  ssh_encoder_release (&enc);
+}
+
+static void write_seed (const char *dir, const char *name, unsigned char kind,
+                        const void *data, size_t len) {
+  char *path;
+  FILE *f;
+
+  if (asprintf (&path, "%s/%s", dir, name) < 0)
+    die ("writing seeds", gpg_error (GPG_ERR_ENOMEM));
+  if (!(f = fopen (path, "wb")) || fputc (kind, f) == EOF ||
+      fwrite (data, 1, len, f) != len || fclose (f))
+    die (path, gpg_error_from_syserror ());
+  free (path);
+}
+
+/* one secret key and one public key seed per key type, and an
+   IDENTITIES_ANSWER listing both public keys */
+static void write_seeds (const char *dir, const struct bench_key *keys, size_t nkeys) {
+  unsigned char answer[4096], *blob, *p = answer;
+  size_t bloblen, i;
+  uint32_t tmp;
+  char name[64];
+  gpg_error_t err;
+
+  *p++ = SSH2_AGENT_IDENTITIES_ANSWER;
+  tmp = htonl (nkeys);
+  memcpy (p, &tmp, 4); p += 4;
+  for (i = 0; i < nkeys; i++) {
+    snprintf (name, sizeof (name), "secret-%s", keys[i].name);
+    write_seed (dir, name, 0, keys[i].sec, keys[i].sec_len);
+    snprintf (name, sizeof (name), "public-%s", keys[i].name);
+    write_seed (dir, name, 1, keys[i].pub, keys[i].pub_len);
+    if ((err = ssh_pubkey_blob (keys[i].pub, keys[i].pub_len, &blob, &bloblen)))
+      die ("public key", err);
+    if (bloblen + 8 + strlen (keys[i].name) > sizeof (answer) - (p - answer))
+      die ("writing seeds", gpg_error (GPG_ERR_TOO_LARGE));
+    tmp = htonl (bloblen);
+    memcpy (p, &tmp, 4); p += 4;
+    memcpy (p, blob, bloblen); p += bloblen;
+    tmp = htonl (strlen (keys[i].name));
+    memcpy (p, &tmp, 4); p += 4;
+    memcpy (p, keys[i].name, strlen (keys[i].name)); p += strlen (keys[i].name);
+    free (blob);
+  }
+  write_seed (dir, "identities", 2, answer, p - answer);
+}
+
+int main (int argc, char *argv[]) {
+  struct exporter e = { .ctx = NULL };
+  struct bench_key keys[2];
+  unsigned char kek[16];
+  unsigned long n = 1000;
+  int bits = 2048, opt;
+  const char *seed_dir = NULL;
+  char genkey[64];
+  gpg_error_t err;
+  size_t i;
+
+  while ((opt = getopt (argc, argv, "n:b:o:")) != -1) {
+    switch (opt) {
+    case 'n': n = strtoul (optarg, NULL, 10); break;
+    case 'b': bits = atoi (optarg); break;
+    case 'o': seed_dir = optarg; break;
+    default:
+      fprintf (stderr, "Usage: agent-transfer-microbench [-n ITERATIONS] [-b RSA-BITS] [-o DIR]\n");
+      return 1;
+    }
+  }
+  if (optind != argc || n == 0 || bits < 1024) {
+    fprintf (stderr, "Usage: agent-transfer-microbench [-n ITERATIONS] [-b RSA-BITS] [-o DIR]\n");
+    return 1;
+  }
+
+  if (!gcry_check_version (GCRYPT_VERSION))
+    die ("libgcrypt", gpg_error (GPG_ERR_NOT_SUPPORTED));
+  gcry_control (GCRYCTL_INIT_SECMEM, SECMEM_POOL_BASE, 0);
+  gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+  gcry_control (GCRYCTL_ENABLE_QUICK_RANDOM, 0);
+
+  /* unwrap_key() wants an exporter that looks connected */
+  if ((err = assuan_new (&e.ctx)) ||
+      (err = gcry_cipher_open (&e.wrap_cipher, KEYWRAP_ALGO, KEYWRAP_ALGO_MODE, GCRY_CIPHER_SECURE)))
+    die ("setting up", err);
+  gcry_randomize (kek, sizeof (kek), GCRY_STRONG_RANDOM);
+  if ((err = gcry_cipher_setkey (e.wrap_cipher, kek, sizeof (kek))))
+    die ("setting up", err);
+  if ((err = extend_wrapped_key (&e, NULL, 0)))
+    die ("setting up", err);
+
+  snprintf (genkey, sizeof (genkey), "(genkey(rsa(nbits %zu:%d)))",
+            (size_t)snprintf (NULL, 0, "%d", bits), bits);
+  make_key (&keys[0], "rsa", genkey, e.wrap_cipher);
+  /* "comp" gets q in the 0x40-prefixed form gpg-agent uses */
+  make_key (&keys[1], "ed25519", "(genkey(ecc(curve Ed25519)(flags eddsa comp)))", e.wrap_cipher);
+
+  if (seed_dir)
+    write_seeds (seed_dir, keys, 2);
+
+  for (i = 0; i < 2; i++)
+    bench (&e, keys + i, n);
+
+  for (i = 0; i < 2; i++) {
+    free (keys[i].wrapped);
+    gcry_free (keys[i].sec);
+    gcry_free (keys[i].pub);
+  }
+  free_exporter (&e);
+  return 0;
+}
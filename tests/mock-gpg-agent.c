@@ -0,0 +1,336 @@
+/* mock-gpg-agent: a stand-in for gpg-agent, for benchmarking
+   agent-transfer without real keys, passphrases or pinentry.
+
+   It listens on a unix-domain socket and speaks just enough of the
+   assuan protocol for agent-transfer: OPTION, SETKEYDESC,
+   KEYWRAP_KEY --export, EXPORT_KEY, READKEY and KEYINFO --list.  The
+   keys are generated fresh at startup and handed out AES-wrapped,
+   just as gpg-agent does.  Clients are served one at a time.
+
+   Usage: mock-gpg-agent [-r N] [-b BITS] [-e N] [-l MS] [-g FILE] [-L FILE] SOCKET
+
+     -r N     generate N RSA keys (default: 0)
+     -b BITS  size of the RSA keys (default: 2048)
+     -e N     generate N Ed25519 keys (default: 1)
+     -l MS    wait MS milliseconds before answering each EXPORT_KEY,
+              to stand in for gpg-agent's own work
+     -g FILE  write the keygrips to FILE, one per line
+     -L FILE  log each EXPORT_KEY and READKEY to FILE, with its keygrip,
+              one per line, whether or not the key is known
+
+   Once the socket is ready, "ready" is printed on stdout. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <gcrypt.h>
+
+#define KEYWRAP_ALGO GCRY_CIPHER_AES128
+#define KEYWRAP_ALGO_MODE GCRY_CIPHER_MODE_AESWRAP
+/* keep D lines well inside assuan's 1000 byte limit */
+#define DATA_CHUNK 300
+
+struct mock_key {
+  char grip[41];
+  unsigned char *wrapped;
+  size_t wrapped_len;
+  unsigned char *pub;
+  size_t pub_len;
+};
+
+struct mock_agent {
+  unsigned char kek[16];
+  struct mock_key *keys;
+  size_t nkeys;
+  int export_delay_ms;
+  FILE *log;
+};
+
+static void die (const char *what, gpg_error_t err) {
+  fprintf (stderr, "mock-gpg-agent: %s: %s\n", what, gpg_strerror (err));
+  exit (1);
+}
+
+/* canonical S-expression, zero-padded to a multiple of 8 octets as
+   AESWRAP requires (gpg-agent does the same) */
+static unsigned char *canon_padded (gcry_sexp_t sexp, size_t *len) {
+  size_t n = gcry_sexp_sprint (sexp, GCRYSEXP_FMT_CANON, NULL, 0);
+  size_t padded = (n + 7) / 8 * 8;
+  unsigned char *buf;
+
+  if (padded < 16)
+    padded = 16;
+  buf = gcry_calloc_secure (1, padded);
+  if (!buf)
+    die ("allocating a key", gpg_error_from_syserror ());
+  gcry_sexp_sprint (sexp, GCRYSEXP_FMT_CANON, buf, n);
+  *len = padded;
+  return buf;
+}
+
+static void make_key (struct mock_agent *a, struct mock_key *k, const char *genkey) {
+  gcry_sexp_t parms, keypair, pub, sec;
+  gcry_cipher_hd_t hd;
+  unsigned char grip[20], *plain;
+  size_t plain_len, i;
+  gpg_error_t err;
+
+  if ((err = gcry_sexp_new (&parms, genkey, 0, 1)) ||
+      (err = gcry_pk_genkey (&keypair, parms)))
+    die ("generating a key", err);
+  pub = gcry_sexp_find_token (keypair, "public-key", 0);
+  sec = gcry_sexp_find_token (keypair, "private-key", 0);
+  if (!pub || !sec || !gcry_pk_get_keygrip (pub, grip))
+    die ("taking the key apart", gpg_error (GPG_ERR_INV_OBJ));
+  for (i = 0; i < 20; i++)
+    sprintf (k->grip + 2 * i, "%02X", grip[i]);
+
+  k->pub_len = gcry_sexp_sprint (pub, GCRYSEXP_FMT_CANON, NULL, 0);
+  k->pub = malloc (k->pub_len);
+  if (!k->pub)
+    die ("allocating a key", gpg_error_from_syserror ());
+  gcry_sexp_sprint (pub, GCRYSEXP_FMT_CANON, k->pub, k->pub_len);
+  /* gcry_sexp_sprint counts the terminating NUL it adds */
+  k->pub_len--;
+
+  plain = canon_padded (sec, &plain_len);
+  k->wrapped_len = plain_len + 8;
+  k->wrapped = malloc (k->wrapped_len);
+  if (!k->wrapped)
+    die ("allocating a key", gpg_error_from_syserror ());
+  if ((err = gcry_cipher_open (&hd, KEYWRAP_ALGO, KEYWRAP_ALGO_MODE, 0)) ||
+      (err = gcry_cipher_setkey (hd, a->kek, sizeof (a->kek))) ||
+      (err = gcry_cipher_encrypt (hd, k->wrapped, k->wrapped_len, plain, plain_len)))
+    die ("wrapping a key", err);
+  gcry_cipher_close (hd);
+  gcry_free (plain);
+  gcry_sexp_release (pub);
+  gcry_sexp_release (sec);
+  gcry_sexp_release (keypair);
+  gcry_sexp_release (parms);
+}
+
+static int write_all (int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  ssize_t w;
+
+  while (len) {
+    w = write (fd, p, len);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += w;
+    len -= w;
+  }
+  return 0;
+}
+
+static int send_line (int fd, const char *line) {
+  return write_all (fd, line, strlen (line)) || write_all (fd, "\n", 1);
+}
+
+static int send_err (int fd, gpg_err_code_t code) {
+  char line[128];
+
+  snprintf (line, sizeof (line), "ERR %u %s",
+            gpg_err_make (GPG_ERR_SOURCE_GPGAGENT, code), gpg_strerror (code));
+  return send_line (fd, line);
+}
+
+/* send DATA as percent-escaped D lines, followed by OK */
+static int send_data (int fd, const unsigned char *data, size_t len) {
+  char line[2 + 3 * DATA_CHUNK + 1];
+  size_t i, n;
+  char *p;
+
+  for (i = 0; i < len; i += n) {
+    n = len - i < DATA_CHUNK ? len - i : DATA_CHUNK;
+    p = line;
+    *p++ = 'D';
+    *p++ = ' ';
+    for (size_t j = 0; j < n; j++) {
+      unsigned char c = data[i + j];
+      if (c == '%' || c == '\r' || c == '\n' || c == '\\' || c == '\0')
+        p += sprintf (p, "%%%02X", c);
+      else
+        *p++ = c;
+    }
+    *p++ = '\n';
+    if (write_all (fd, line, p - line))
+      return -1;
+  }
+  return send_line (fd, "OK");
+}
+
+static const struct mock_key *find_key (const struct mock_agent *a, const char *grip) {
+  size_t i;
+
+  for (i = 0; i < a->nkeys; i++)
+    if (!strcasecmp (a->keys[i].grip, grip))
+      return a->keys + i;
+  return NULL;
+}
+
+static void sleep_ms (int ms) {
+  struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+
+  while (nanosleep (&ts, &ts) && errno == EINTR)
+    ;
+}
+
+/* answer one command line; returns -1 when the client should be
+   dropped */
+static int handle (const struct mock_agent *a, int fd, char *line) {
+  const struct mock_key *k;
+  char status[128];
+  size_t i;
+
+  if (a->log && (!strncasecmp (line, "EXPORT_KEY ", 11) || !strncasecmp (line, "READKEY ", 8))) {
+    fprintf (a->log, "%s\n", line);
+    fflush (a->log);
+  }
+
+  if (!strncasecmp (line, "OPTION ", 7) || !strncasecmp (line, "SETKEYDESC ", 11) ||
+      !strcasecmp (line, "RESET") || !strcasecmp (line, "NOP"))
+    return send_line (fd, "OK");
+  if (!strcasecmp (line, "BYE")) {
+    send_line (fd, "OK closing connection");
+    return -1;
+  }
+  if (!strcasecmp (line, "KEYWRAP_KEY --export"))
+    return send_data (fd, a->kek, sizeof (a->kek));
+  if (!strncasecmp (line, "EXPORT_KEY ", 11)) {
+    if (!(k = find_key (a, line + 11)))
+      return send_err (fd, GPG_ERR_NO_SECKEY);
+    if (a->export_delay_ms)
+      sleep_ms (a->export_delay_ms);
+    return send_data (fd, k->wrapped, k->wrapped_len);
+  }
+  if (!strncasecmp (line, "READKEY ", 8)) {
+    if (!(k = find_key (a, line + 8)))
+      return send_err (fd, GPG_ERR_NO_PUBKEY);
+    return send_data (fd, k->pub, k->pub_len);
+  }
+  if (!strcasecmp (line, "KEYINFO --list")) {
+    for (i = 0; i < a->nkeys; i++) {
+      snprintf (status, sizeof (status), "S KEYINFO %s D - - - P - - -", a->keys[i].grip);
+      if (send_line (fd, status))
+        return -1;
+    }
+    return send_line (fd, "OK");
+  }
+  return send_err (fd, GPG_ERR_ASS_UNKNOWN_CMD);
+}
+
+static void serve (const struct mock_agent *a, int fd) {
+  FILE *in = fdopen (dup (fd), "r");
+  char *line = NULL;
+  size_t alloc = 0;
+  ssize_t len;
+
+  if (!in)
+    return;
+  if (send_line (fd, "OK Pleased to meet you (mock)"))
+    goto out;
+  while ((len = getline (&line, &alloc, in)) > 0) {
+    while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    if (handle (a, fd, line))
+      break;
+  }
+ out:
+  free (line);
+  fclose (in);
+}
+
+int main (int argc, char *argv[]) {
+  struct mock_agent a = { .nkeys = 0 };
+  struct sockaddr_un sa;
+  const char *grip_file = NULL, *log_file = NULL;
+  int nrsa = 0, ned = 1, bits = 2048, opt, lfd, fd;
+  char genkey[128];
+  FILE *f;
+  size_t i;
+
+  while ((opt = getopt (argc, argv, "r:b:e:l:g:L:")) != -1) {
+    switch (opt) {
+    case 'r': nrsa = atoi (optarg); break;
+    case 'b': bits = atoi (optarg); break;
+    case 'e': ned = atoi (optarg); break;
+    case 'l': a.export_delay_ms = atoi (optarg); break;
+    case 'g': grip_file = optarg; break;
+    case 'L': log_file = optarg; break;
+    default:
+      fprintf (stderr, "Usage: mock-gpg-agent [-r N] [-b BITS] [-e N] [-l MS] [-g FILE] [-L FILE] SOCKET\n");
+      return 1;
+    }
+  }
+  if (optind != argc - 1 || nrsa < 0 || ned < 0 || bits < 1024 || a.export_delay_ms < 0) {
+    fprintf (stderr, "Usage: mock-gpg-agent [-r N] [-b BITS] [-e N] [-l MS] [-g FILE] [-L FILE] SOCKET\n");
+    return 1;
+  }
+
+  if (!gcry_check_version (GCRYPT_VERSION))
+    die ("libgcrypt", gpg_error (GPG_ERR_NOT_SUPPORTED));
+  gcry_control (GCRYCTL_INIT_SECMEM, 256 * 1024, 0);
+  gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+  /* test keys don't need the best randomness there is */
+  gcry_control (GCRYCTL_ENABLE_QUICK_RANDOM, 0);
+
+  gcry_randomize (a.kek, sizeof (a.kek), GCRY_STRONG_RANDOM);
+  a.keys = calloc (nrsa + ned ? nrsa + ned : 1, sizeof (*a.keys));
+  if (!a.keys)
+    die ("allocating keys", gpg_error_from_syserror ());
+  snprintf (genkey, sizeof (genkey), "(genkey(rsa(nbits %zu:%d)))",
+            (size_t)snprintf (NULL, 0, "%d", bits), bits);
+  for (; a.nkeys < (size_t)nrsa; a.nkeys++)
+    make_key (&a, a.keys + a.nkeys, genkey);
+  /* "comp" gets q in the 0x40-prefixed form gpg-agent uses */
+  for (; a.nkeys < (size_t)(nrsa + ned); a.nkeys++)
+    make_key (&a, a.keys + a.nkeys, "(genkey(ecc(curve Ed25519)(flags eddsa comp)))");
+
+  if (grip_file) {
+    if (!(f = fopen (grip_file, "w")))
+      die (grip_file, gpg_error_from_syserror ());
+    for (i = 0; i < a.nkeys; i++)
+      fprintf (f, "%s\n", a.keys[i].grip);
+    fclose (f);
+  }
+
+  if (log_file && !(a.log = fopen (log_file, "a")))
+    die (log_file, gpg_error_from_syserror ());
+
+  if (strlen (argv[optind]) >= sizeof (sa.sun_path))
+    die (argv[optind], gpg_error (GPG_ERR_ENAMETOOLONG));
+  memset (&sa, 0, sizeof (sa));
+  sa.sun_family = AF_UNIX;
+  strcpy (sa.sun_path, argv[optind]);
+  unlink (sa.sun_path);
+  lfd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (lfd < 0 || bind (lfd, (struct sockaddr *)&sa, sizeof (sa)) || listen (lfd, 8))
+    die (argv[optind], gpg_error_from_syserror ());
+  signal (SIGPIPE, SIG_IGN);
+  printf ("ready\n");
+  fflush (stdout);
+
+  for (;;) {
+    fd = accept (lfd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      die ("accept", gpg_error_from_syserror ());
+    }
+    serve (&a, fd);
+    close (fd);
+  }
+}
@@ -0,0 +1,277 @@
+/* mock-ssh-agent: a minimal ssh-agent, for benchmarking
+   agent-transfer.
+
+   It listens on a unix-domain socket and understands
+   REQUEST_IDENTITIES, ADD_IDENTITY, ADD_ID_CONSTRAINED,
+   REMOVE_IDENTITY and REMOVE_ALL_IDENTITIES.  Added keys are never
+   used: only their public halves are remembered, so that later
+   REQUEST_IDENTITIES answers list them.  Clients are served one at a
+   time.
+
+   Usage: mock-ssh-agent SOCKET
+
+   Once the socket is ready, "ready" is printed on stdout. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "../src/agent-transfer/ssh-agent-proto.h"
+
+#define MAX_MSG (256 * 1024)
+
+struct blob {
+  unsigned char *data;
+  uint32_t len;
+};
+
+static struct blob *held;
+static size_t nheld, held_alloc;
+
+static int read_all (int fd, void *buf, size_t len) {
+  char *p = buf;
+  ssize_t r;
+
+  while (len) {
+    r = read (fd, p, len);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    p += r;
+    len -= r;
+  }
+  return 0;
+}
+
+static int write_all (int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  ssize_t w;
+
+  while (len) {
+    w = write (fd, p, len);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += w;
+    len -= w;
+  }
+  return 0;
+}
+
+/* a cursor over a request, which never reads past its end */
+struct cursor {
+  const unsigned char *p;
+  size_t left;
+};
+
+static int get_string (struct cursor *c, const unsigned char **s, uint32_t *len) {
+  uint32_t l;
+
+  if (c->left < 4)
+    return -1;
+  memcpy (&l, c->p, 4);
+  l = ntohl (l);
+  if (l > c->left - 4)
+    return -1;
+  *s = c->p + 4;
+  *len = l;
+  c->p += 4 + l;
+  c->left -= 4 + l;
+  return 0;
+}
+
+static int find_held (const unsigned char *blob, uint32_t len) {
+  size_t i;
+
+  for (i = 0; i < nheld; i++)
+    if (held[i].len == len && !memcmp (held[i].data, blob, len))
+      return i;
+  return -1;
+}
+
+/* remember the public key blob of the key in an ADD_IDENTITY
+   request: the key type, followed by e and n (RSA) or the public
+   point (Ed25519) */
+static int add_identity (struct cursor *c) {
+  const unsigned char *type, *f[2];
+  uint32_t typelen, flen[2], bloblen, tmp;
+  unsigned char *blob, *p;
+  struct blob *n;
+
+  if (get_string (c, &type, &typelen))
+    return -1;
+  if (typelen == 7 && !memcmp (type, "ssh-rsa", 7)) {
+    /* n, e, d, iqmp, p, q: the public key is e, n */
+    if (get_string (c, &f[1], &flen[1]) || get_string (c, &f[0], &flen[0]))
+      return -1;
+  } else if (typelen == 11 && !memcmp (type, "ssh-ed25519", 11)) {
+    if (get_string (c, &f[0], &flen[0]))
+      return -1;
+    flen[1] = 0;
+    f[1] = NULL;
+  } else {
+    return -1;
+  }
+
+  bloblen = 4 + typelen + 4 + flen[0] + (f[1] ? 4 + flen[1] : 0);
+  blob = p = malloc (bloblen);
+  if (!blob)
+    return -1;
+#define wstr(s, l) { tmp = htonl (l); memcpy (p, &tmp, 4); p += 4; memcpy (p, s, l); p += l; }
+  wstr (type, typelen);
+  wstr (f[0], flen[0]);
+  if (f[1])
+    wstr (f[1], flen[1]);
+#undef wstr
+  if (find_held (blob, bloblen) >= 0) {
+    free (blob);
+    return 0;
+  }
+  if (nheld == held_alloc) {
+    n = realloc (held, (held_alloc ? held_alloc * 2 : 16) * sizeof (*held));
+    if (!n) {
+      free (blob);
+      return -1;
+    }
+    held = n;
+    held_alloc = held_alloc ? held_alloc * 2 : 16;
+  }
+  held[nheld].data = blob;
+  held[nheld++].len = bloblen;
+  return 0;
+}
+
+static int remove_identity (struct cursor *c) {
+  const unsigned char *blob;
+  uint32_t len;
+  int i;
+
+  if (get_string (c, &blob, &len) || (i = find_held (blob, len)) < 0)
+    return -1;
+  free (held[i].data);
+  held[i] = held[--nheld];
+  return 0;
+}
+
+static int send_identities (int fd) {
+  size_t len = 1 + 4, i;
+  unsigned char *msg, *p;
+  uint32_t tmp;
+  int ret;
+
+  for (i = 0; i < nheld; i++)
+    len += 4 + held[i].len + 4;
+  msg = p = malloc (4 + len);
+  if (!msg)
+    return -1;
+#define w32(a) { tmp = htonl (a); memcpy (p, &tmp, 4); p += 4; }
+  w32 (len);
+  *p++ = SSH2_AGENT_IDENTITIES_ANSWER;
+  w32 (nheld);
+  for (i = 0; i < nheld; i++) {
+    w32 (held[i].len);
+    memcpy (p, held[i].data, held[i].len);
+    p += held[i].len;
+    w32 (0); /* empty comment */
+  }
+#undef w32
+  ret = write_all (fd, msg, 4 + len);
+  free (msg);
+  return ret;
+}
+
+static int send_byte (int fd, unsigned char b) {
+  unsigned char msg[5] = { 0, 0, 0, 1, b };
+  return write_all (fd, msg, sizeof (msg));
+}
+
+static void serve (int fd) {
+  unsigned char *msg = malloc (MAX_MSG);
+  struct cursor c;
+  uint32_t len;
+  int ok;
+
+  if (!msg)
+    return;
+  while (!read_all (fd, &len, 4)) {
+    len = ntohl (len);
+    if (len == 0 || len > MAX_MSG || read_all (fd, msg, len))
+      break;
+    c.p = msg + 1;
+    c.left = len - 1;
+    switch (msg[0]) {
+    case SSH2_AGENTC_REQUEST_IDENTITIES:
+      if (send_identities (fd))
+        goto out;
+      continue;
+    case SSH2_AGENTC_ADD_IDENTITY:
+    case SSH2_AGENTC_ADD_ID_CONSTRAINED:
+      ok = !add_identity (&c);
+      break;
+    case SSH2_AGENTC_REMOVE_IDENTITY:
+      ok = !remove_identity (&c);
+      break;
+    case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
+      while (nheld)
+        free (held[--nheld].data);
+      ok = 1;
+      break;
+    default:
+      ok = 0;
+    }
+    memset (msg, 0, len);
+    if (send_byte (fd, ok ? SSH_AGENT_SUCCESS : SSH_AGENT_FAILURE))
+      break;
+  }
+ out:
+  free (msg);
+}
+
+int main (int argc, char *argv[]) {
+  struct sockaddr_un sa;
+  int lfd, fd;
+
+  if (argc != 2) {
+    fprintf (stderr, "Usage: mock-ssh-agent SOCKET\n");
+    return 1;
+  }
+  if (strlen (argv[1]) >= sizeof (sa.sun_path)) {
+    fprintf (stderr, "mock-ssh-agent: socket path too long\n");
+    return 1;
+  }
+  memset (&sa, 0, sizeof (sa));
+  sa.sun_family = AF_UNIX;
+  strcpy (sa.sun_path, argv[1]);
+  unlink (sa.sun_path);
+  lfd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (lfd < 0 || bind (lfd, (struct sockaddr *)&sa, sizeof (sa)) || listen (lfd, 8)) {
+    perror ("mock-ssh-agent");
+    return 1;
+  }
+  signal (SIGPIPE, SIG_IGN);
+  printf ("ready\n");
+  fflush (stdout);
+
+  for (;;) {
+    fd = accept (lfd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      perror ("mock-ssh-agent");
+      return 1;
+    }
+    serve (fd);
+    close (fd);
+  }
+}